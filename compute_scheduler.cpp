@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2015, 2017, 2020 Kent A. Vander Velden, kent.vandervelden@gmail.com
+ *
+ * This file is part of BinVis.
+ *
+ *     BinVis is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     BinVis is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with BinVis.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "compute_scheduler.h"
+#include "thread_pool.h"
+
+ComputeScheduler::ComputeScheduler() : gen_(0), cpu_ns_(std::make_shared<std::atomic<int64_t> >(0)) {}
+
+ComputeScheduler::~ComputeScheduler() {
+    stop();
+}
+
+/// run cancels the previous request and queues fn on the thread pool as the next generation.
+/// @param [in] opts Options for the kernels, to which the request's cancellation flag is added.
+/// @param [in] fn The request.
+/// @return The generation of the request.
+int ComputeScheduler::run(const calc_opts_t &opts, task_t fn) {
+    cancel();
+
+    auto flag = std::make_shared<std::atomic<bool> >(false);
+    cancel_ = flag;
+
+    int gen = gen_;
+    calc_opts_t o = opts;
+    o.cancel = flag.get();
+
+    auto cpu = cpu_ns_;
+    auto task = std::make_shared<std::packaged_task<void()> >([flag, o, gen, fn, cpu]() {
+        // Superseded while queued
+        if (*flag) return;
+
+        CpuCharge charge(cpu.get());
+        fn(o, gen);
+    });
+    running_.push_back(task->get_future());
+    ThreadPool::instance().submit([task]() { (*task)(); });
+
+    return gen;
+}
+
+/// cancel abandons the current request, if any, so that its result is stale even if it has already been delivered.
+void ComputeScheduler::cancel() {
+    gen_++;
+    if (cancel_) {
+        *cancel_ = true;
+        cancel_.reset();
+    }
+
+    reap(false);
+}
+
+/// stop cancels the current request and waits for every request to finish, as must be done before the data they
+/// read is released.
+void ComputeScheduler::stop() {
+    cancel();
+    reap(true);
+}
+
+/// reap forgets the requests that have finished, first waiting for all of them if wait.
+void ComputeScheduler::reap(bool wait) {
+    auto it = running_.begin();
+    while (it != running_.end()) {
+        if (wait) it->wait();
+        if (it->wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+            it = running_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2015, 2017, 2020 Kent A. Vander Velden, kent.vandervelden@gmail.com
+ *
+ * This file is part of BinVis.
+ *
+ *     BinVis is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     BinVis is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with BinVis.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _COMPUTE_SCHEDULER_H_
+#define _COMPUTE_SCHEDULER_H_
+
+#include <atomic>
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+
+#include "histogram_calc.h"
+
+/// ComputeScheduler runs a stream of requests for the same result on the thread pool, each request superseding the
+/// one before it. Starting a request cancels the previous one: if still queued it never runs, and if running its
+/// kernels stop at their next window, as they poll the cancellation flag passed in its calc_opts_t. Each request is
+/// numbered with a generation, which the task reports along with its result so the receiver can discard stale ones.
+class ComputeScheduler {
+public:
+    /// A request, called with the options to pass to the kernels and the request's generation.
+    typedef std::function<void(const calc_opts_t &opts, int gen)> task_t;
+
+    ComputeScheduler();
+
+    ~ComputeScheduler();
+
+    ComputeScheduler(const ComputeScheduler &) = delete;
+
+    ComputeScheduler &operator=(const ComputeScheduler &) = delete;
+
+    int run(const calc_opts_t &opts, task_t fn);
+
+    void cancel();
+
+    void stop();
+
+    int generation() const { return gen_; }
+
+    bool isCurrent(int gen) const { return gen == gen_; }
+
+    /// cpu_ns returns the CPU time its requests have used so far, in nanoseconds, see CpuCharge.
+    int64_t cpu_ns() const { return *cpu_ns_; }
+
+protected:
+    void reap(bool wait);
+
+    int gen_;
+    std::shared_ptr<std::atomic<bool> > cancel_;
+    std::shared_ptr<std::atomic<int64_t> > cpu_ns_;
+    // Requests still queued or running, including cancelled ones
+    std::list<std::future<void> > running_;
+};
+
+/// ResultSlot hands the latest result of a request from the thread pool to the GUI thread, which is told of it by a
+/// queued call and takes it then. A result not yet taken when the next is put is replaced, so a request may deliver a
+/// quick estimate and then the exact result without the GUI thread keeping up with both.
+template<class T>
+class ResultSlot {
+public:
+    ResultSlot() : full_(false) {}
+
+    void put(T v) {
+        std::lock_guard<std::mutex> lk(m_);
+        v_ = std::move(v);
+        full_ = true;
+    }
+
+    bool take(T &v) {
+        std::lock_guard<std::mutex> lk(m_);
+        if (!full_) return false;
+        v = std::move(v_);
+        full_ = false;
+        return true;
+    }
+
+protected:
+    std::mutex m_;
+    T v_;
+    bool full_;
+};
+
+#endif
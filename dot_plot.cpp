@@ -47,8 +47,7 @@ long random() { return rand(); }
 DotPlot::DotPlot(QWidget *p)
         : QLabel(p),
           dat_(nullptr), dat_n_(0),
-          mat_(nullptr), mat_max_n_(0), mat_n_(0),
-          pts_i_(0) {
+          mat_max_n_(0), mat_n_(0) {
     {
         auto layout = new QGridLayout(this);
         int r = 0;
@@ -136,7 +135,7 @@ DotPlot::DotPlot(QWidget *p)
 }
 
 DotPlot::~DotPlot() {
-    delete[] mat_;
+    plot_.stop();
 }
 
 void DotPlot::setImage(QImage &img) {
@@ -163,10 +162,8 @@ void DotPlot::resizeEvent(QResizeEvent *e) {
 
     int tmp = min(width(), height());
     if (tmp != mat_max_n_) {
-        delete[] mat_;
         mat_max_n_ = tmp;
         mat_n_ = 0;
-        mat_ = new int[mat_max_n_ * mat_max_n_];
     }
 
     parameters_changed();
@@ -196,9 +193,20 @@ void DotPlot::setData(const unsigned char *dat, long n) {
     // parameters_changed();
 }
 
+/// resetData forgets the current data, which is about to be unmapped, waiting for any plot being sampled from it.
+void DotPlot::resetData() {
+    plot_.stop();
+    dat_ = nullptr;
+    dat_n_ = 0;
+}
+
+/// parameters_changed samples the dot plot on the thread pool, delivering its image to imageReady(). The previous
+/// image is shown until then.
 void DotPlot::parameters_changed() {
     puts("called");
 
+    if (mat_max_n_ == 0) return;
+
     long mdw = min(dat_n_, (long) width_->value());
     int bs = int(mdw / mat_max_n_) + ((mdw % mat_max_n_) > 0 ? 1 : 0);
     mat_n_ = 0;
@@ -211,55 +219,67 @@ void DotPlot::parameters_changed() {
 
     printf("dat_n_%d mdw:%d mat_max_n_:%d bs:%d mat_n_:%d bs * mat_n_:%d\n", dat_n_, mdw, mat_max_n_, bs, mat_n_, bs * mat_n_);
 
-    memset(mat_, 0, sizeof(mat_[0]) * mat_max_n_ * mat_max_n_);
+    const unsigned char *dat = dat_;
+    int mat_n = mat_n_;
+    int max_samples = max_samples_->value();
+    plot_.run(calc_opts_t(), [=](const calc_opts_t &opts, int gen) {
+        vector<int> mat(mat_n * mat_n, 0);
+        if (!sample_mat(dat, mat.data(), mat_n, bs, max_samples, *opts.cancel)) return;
+
+        QImage img = mat_image(mat.data(), mat_n);
+        if (!*opts.cancel) {
+            QMetaObject::invokeMethod(this, "imageReady", Qt::QueuedConnection, Q_ARG(int, gen), Q_ARG(QImage, img));
+        }
+    });
+}
+
+/// imageReady shows the image sampled by parameters_changed(), unless the data or parameters have changed since.
+void DotPlot::imageReady(int gen, const QImage &img) {
+    if (!plot_.isCurrent(gen)) return;
 
-    pts_.clear();
-    pts_.reserve(mat_n_ * mat_n_);
+    img_ = img;
+    update_pix();
+    update();
+}
+
+/// sample_mat counts matching bytes between random samples of each pair of the mat_n blocks of bs bytes of dat, in
+/// a random order of the pairs, into mat.
+/// @return false if cancelled, polled every 100 pairs
+bool DotPlot::sample_mat(const unsigned char *dat, int *mat, int mat_n, int bs, int max_samples,
+                         const std::atomic<bool> &cancel) {
+    vector<pair<int, int> > pts;
+    pts.reserve(mat_n * mat_n);
 #if 1
-    for (int i = 0; i < mat_n_; i++) {
-        for (int j = i; j < mat_n_; j++) {
-            pts_.emplace_back(make_pair(i, j));
+    for (int i = 0; i < mat_n; i++) {
+        for (int j = i; j < mat_n; j++) {
+            pts.emplace_back(make_pair(i, j));
         }
     }
 #else
-    for (int i = 0; i < mat_n_; i++) {
-        pts_.emplace_back(make_pair(i, mat_n_-i-1));
-//        pts_.emplace_back(make_pair(i, i));
+    for (int i = 0; i < mat_n; i++) {
+        pts.emplace_back(make_pair(i, mat_n-i-1));
+//        pts.emplace_back(make_pair(i, i));
     }
 #endif
-    random_shuffle(pts_.begin(), pts_.end());
+    random_shuffle(pts.begin(), pts.end());
 
     {
-//        float sf = 1.f;
-//        if (mwh < mdw) {
-//            sf = mwh / float(mdw);
-//        }
-//
-//        int xyn = 1 / sf + 1;
-
-//        printf("min(width(), height()): %d mwh:%d mdw:%d dat_n:%d sf:%f xyn:%d", min(width(), height()), mwh, mdw, dat_n_, sf, xyn);
-
-
-//        printf("pts_.size(): %d sf: %f\n", pts_.size(), sf);
-        // pts_i_ is decremented in advance_mat()
-        pts_i_ = pts_.size();
+        int pts_i = pts.size();
         int ii = 0;
         // Precompute some random values for sampling
         std::vector<pair<int, int> > rand;
-        while (pts_i_ > 0) {
+        while (pts_i > 0) {
             if ((ii++ % 100) == 0) {
+                if (cancel) return false;
                 {
-                    int n = min(max_samples_->value(), bs);
-//            n = n * n;
+                    int n = min(max_samples, bs);
                     rand.clear();
                     rand.reserve(n);
-                    printf("Generating %d points in range [0, %d-1] along the diagonal\n", n, bs);
                     for (int tt = 0; tt < n; tt++) {
                         int a = random() % bs;
                         rand.emplace_back(make_pair(a, a));
                     }
-                    int n2 = min(max_samples_->value(), bs * bs - bs);
-                    printf("Generating %d points in range [0, %d-1] off the diagonal\n", n2, bs);
+                    int n2 = min(max_samples, bs * bs - bs);
                     for (int tt = 0; tt < n2;) {
                         int a = random() % bs;
                         int b = random() % bs;
@@ -267,106 +287,64 @@ void DotPlot::parameters_changed() {
                         rand.emplace_back(make_pair(a, b));
                         tt++;
                     }
-//            for (int tt = 0; tt < n; tt++) {
-//                rand.emplace_back(make_pair(random() % bs, random() % bs));
-//            }
                 }
             }
 
-
-//            random_shuffle(rand.begin(), rand.end());
-            advance_mat(bs, rand);
+            pts_i--;
+            advance_mat(dat, mat, mat_n, bs, pts[pts_i], rand);
         }
     }
-    regen_image();
+    return true;
 }
 
-void DotPlot::advance_mat(int bs, const vector<pair<int, int> > &rand) {
-    if (pts_i_ == 0 || pts_.empty()) return;
-
-    pts_i_--;
-    pair<int, int> pt = pts_[pts_i_];
-
+/// advance_mat counts matching bytes between the samples rand of the pair of blocks pt into mat.
+void DotPlot::advance_mat(const unsigned char *dat, int *mat, int mat_n, int bs, pair<int, int> pt,
+                          const vector<pair<int, int> > &rand) {
     int x = pt.first;
     int y = pt.second;
 
     int xo = x * bs;
     int yo = y * bs;
 
-    if (true) {
-//        for (int tt = 0; tt < bs; tt++) {
-//            int i = xo + tt;
-//            int j = yo + tt;
-//
-//            if (dat_[i] == dat_[j]) {
-//                int ii = y * mat_n_ + x;
-//                int jj = x * mat_n_ + y;
-//                if (0 <= ii && ii < mat_n_ * mat_n_) mat_[ii]++;
-//                if (0 <= jj && jj < mat_n_ * mat_n_) mat_[jj]++;
-//            }
-////            printf("%d %d %d %d %d %d %d %d\n", xo, yo, tt, rand[tt], i, j, dat_[i], dat_[j]);
-//        }
-        for (int tt = 0; tt < rand.size(); tt++) {
-            int i = xo + rand[tt].first;
-            int j = yo + rand[tt].second;
-//            int i = xo + (random() % bs);
-//            int j = yo + (random() % bs);
-
-            if (dat_[i] == dat_[j]) {
-                int ii = y * mat_n_ + x;
-                int jj = x * mat_n_ + y;
-                if (0 <= ii && ii < mat_n_ * mat_n_) mat_[ii]++;
-                if (0 <= jj && jj < mat_n_ * mat_n_) mat_[jj]++;
-            }
-//            printf("%d %d %d %d %d %d %d %d\n", xo, yo, tt, rand[tt], i, j, dat_[i], dat_[j]);
-        }
-    } else {
-        for (int tt1 = 0; tt1 < bs; tt1++) {
-            for (int tt2 = 0; tt2 < bs; tt2++) {
-                int i = xo + tt1;
-                int j = yo + tt2;
-
-                if (dat_[i] == dat_[j]) {
-                    int ii = y * mat_n_ + x;
-                    int jj = x * mat_n_ + y;
-                    if (0 <= ii && ii < mat_n_ * mat_n_) mat_[ii]++;
-//                    else abort();
-                    if (0 <= jj && jj < mat_n_ * mat_n_) mat_[jj]++;
-//                    else abort();
-                }
-                printf("%d %d %d %d %d %d %d %d\n", xo, yo, tt1, tt2, i, j, dat_[i], dat_[j]);
-            }
+    for (int tt = 0; tt < rand.size(); tt++) {
+        int i = xo + rand[tt].first;
+        int j = yo + rand[tt].second;
+
+        if (dat[i] == dat[j]) {
+            int ii = y * mat_n + x;
+            int jj = x * mat_n + y;
+            if (0 <= ii && ii < mat_n * mat_n) mat[ii]++;
+            if (0 <= jj && jj < mat_n * mat_n) mat[jj]++;
         }
     }
 }
 
-void DotPlot::regen_image() {
+/// mat_image renders the counts mat of the dot plot as an image.
+QImage DotPlot::mat_image(const int *mat, int mat_n) {
     // Find the maximum value, ignoring the diagonal.
     // Could stop the search once m = max_samples_->value()
     int m = 0;
-    for (int j = 0; j < mat_n_; j++) {
+    for (int j = 0; j < mat_n; j++) {
         for (int i = 0; i < j; i++) {
-            int k = j * mat_n_ + i;
-            if (m < mat_[k]) m = mat_[k];
+            int k = j * mat_n + i;
+            if (m < mat[k]) m = mat[k];
         }
-        for (int i = j + 1; i < mat_n_; i++) {
-            int k = j * mat_n_ + i;
-            if (m < mat_[k]) m = mat_[k];
+        for (int i = j + 1; i < mat_n; i++) {
+            int k = j * mat_n + i;
+            if (m < mat[k]) m = mat[k];
         }
     }
 
-    printf("max(1): %d\n", m);
     if (true) {
         // Brighten image
         m = max(1, int(m * .75));
-        printf("max(2): %d\n", m);
     }
 
-    QImage img(mat_n_, mat_n_, QImage::Format_RGB32);
+    QImage img(mat_n, mat_n, QImage::Format_RGB32);
     img.fill(0);
     auto p = (unsigned int *) img.bits();
-    for (int i = 0; i < mat_n_ * mat_n_; i++) {
-        int c = min(255, int(mat_[i] / float(m) * 255. + .5));
+    for (int i = 0; i < mat_n * mat_n; i++) {
+        int c = min(255, int(mat[i] / float(m) * 255. + .5));
         unsigned char r = c;
         unsigned char g = c;
         unsigned char b = c;
@@ -374,11 +352,5 @@ void DotPlot::regen_image() {
         *p++ = v;
     }
 
-    img.save("a.png");
-
-//    long mdw = min(dat_n_, (long) width_->value());
-//    int mwh = min(width(), height());
-//    if (mwh > mdw) mwh = mdw;
-
-    setImage(img);
+    return img;
 }
@@ -20,12 +20,16 @@
 #ifndef _DOTPLOT_H_
 #define _DOTPLOT_H_
 
+#include <atomic>
+#include <utility>
 #include <vector>
 
 #include <QLabel>
 #include <QImage>
 #include <QPixmap>
 
+#include "compute_scheduler.h"
+
 class QSpinBox;
 
 class DotPlot : public QLabel {
@@ -35,19 +39,22 @@ public:
 
     ~DotPlot() override;
 
+    /// cpu_ns returns the CPU time spent computing what it shows, in nanoseconds.
+    int64_t cpu_ns() const { return plot_.cpu_ns(); }
+
 public slots:
 
     void setData(const unsigned char *dat, long n);
 
+    void resetData();
+
     void parameters_changed();
 
 protected slots:
 
     void setImage(QImage &img);
 
-    void advance_mat(int bs, const std::vector<std::pair<int, int> > &rand);
-
-    void regen_image();
+    void imageReady(int gen, const QImage &img);
 
 protected:
     QImage img_;
@@ -62,11 +69,17 @@ protected:
     QSpinBox *offset1_, *offset2_, *width_, *max_samples_;
     const unsigned char *dat_;
     long dat_n_;
-    int *mat_;
     int mat_max_n_;
     int mat_n_;
-    std::vector<std::pair<int, int> > pts_;
-    int pts_i_;
+    ComputeScheduler plot_;
+
+    static bool sample_mat(const unsigned char *dat, int *mat, int mat_n, int bs, int max_samples,
+                           const std::atomic<bool> &cancel);
+
+    static void advance_mat(const unsigned char *dat, int *mat, int mat_n, int bs, std::pair<int, int> pt,
+                            const std::vector<std::pair<int, int> > &rand);
+
+    static QImage mat_image(const int *mat, int mat_n);
 };
 
 #endif
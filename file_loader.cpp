@@ -0,0 +1,207 @@
+/*
+ * Copyright (c) 2015, 2017, 2020 Kent A. Vander Velden, kent.vandervelden@gmail.com
+ *
+ * This file is part of BinVis.
+ *
+ *     BinVis is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     BinVis is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with BinVis.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <limits>
+
+#include <QElapsedTimer>
+#include <QSettings>
+
+#include "file_loader.h"
+#include "mapped_file.h"
+#include "overall_view.h"
+#include "summary_cache.h"
+
+using std::min;
+
+// Minimum time between partial results, to keep the GUI thread responsive
+static const qint64 report_interval_ms = 100;
+
+// Window used to report progress when the file is not being streamed anyway
+static const long progress_window = 16L << 20;
+
+static QElapsedTimer report_clock;
+
+/// bytes returns the memory held by the summary.
+long FileSummary::bytes() const {
+    return long(overview.bytesPerLine()) * overview.height() + long(histogram.size()) * long(sizeof(float)) +
+           pyramid.bytes() + index.bytes();
+}
+
+/// stream_opts returns the options used to analyze file. Files larger than the stream_threshold_mb setting are
+/// scanned in windows of stream_window_mb, each dropped from memory once processed, so that memory use is bounded
+/// by the window rather than the file length.
+/// @param [in] file The file to be analyzed, which must outlive the returned options.
+/// @return The options to pass to the kernels and views.
+calc_opts_t stream_opts(const MappedFile &file) {
+    calc_opts_t opts;
+
+    QSettings settings;
+    long threshold = settings.value("stream_threshold_mb", 1024).toLongLong() << 20;
+    if (file.size() <= threshold) return opts;
+
+    opts.window = std::max(1LL, settings.value("stream_window_mb", 64).toLongLong()) << 20;
+    // The entropy strip is only shown at screen resolution
+    opts.max_out = 1 << 20;
+    opts.release = [&file](const unsigned char *p, long len) { file.release(p, len); };
+
+    return opts;
+}
+
+/// FileLoader prepares, but does not start, the analysis of a file.
+/// @param [in] gen Generation reported with every result.
+/// @param [in] dat The file data, which must remain mapped until the loader has finished.
+/// @param [in] len Length of dat in bytes.
+/// @param [in] start Start of the range whose entropy and histogram are computed.
+/// @param [in] end End of the range whose entropy and histogram are computed.
+/// @param [in] w Width of the overview.
+/// @param [in] h Height of the overview.
+/// @param [in] use_byte_classes Overview colouring, see render_overview().
+/// @param [in] use_hilbert_curve Overview layout, see render_overview().
+/// @param [in] opts Controls streaming of dat.
+/// @param [in] p Parent object.
+FileLoader::FileLoader(int gen, const unsigned char *dat, long len, long start, long end,
+                       int w, int h, bool use_byte_classes, bool use_hilbert_curve,
+                       const calc_opts_t &opts, QObject *p)
+        : QThread(p), gen_(gen), dat_(dat), len_(len), start_(start), end_(end), w_(w), h_(h),
+          use_byte_classes_(use_byte_classes), use_hilbert_curve_(use_hilbert_curve),
+          opts_(opts), cancel_(false), last_report_(0), report_progress_(true) {
+    qRegisterMetaType<QVector<float> >("QVector<float>");
+
+    if (opts_.window == 0) opts_.window = progress_window;
+    opts_.cancel = &cancel_;
+
+    if (!report_clock.isValid()) report_clock.start();
+}
+
+FileLoader::~FileLoader() {
+    cancel();
+    wait();
+}
+
+/// cancel asks the loader to stop at the end of the current window. No further results are reported.
+void FileLoader::cancel() {
+    cancel_ = true;
+}
+
+/// setCacheFile has the loader read the summary of filename, the file being analyzed, from the summary cache if it
+/// is there, and otherwise write it there once computed. See summary_cache_path().
+void FileLoader::setCacheFile(const QString &filename) {
+    filename_ = filename;
+}
+
+bool FileLoader::report_due() {
+    if (!report_progress_) return false;
+
+    qint64 t = report_clock.elapsed();
+    if (t - last_report_ < report_interval_ms) return false;
+    last_report_ = t;
+    return true;
+}
+
+void FileLoader::run() {
+    last_report_ = report_clock.elapsed();
+
+    // The parts of the summary found in the cache are used as is
+    FileSummary cached;
+    QString cache_path;
+    if (!filename_.isEmpty()) {
+        cache_path = summary_cache_path(filename_, dat_, len_);
+        read_summary_cache(cache_path, len_, cached);
+    }
+    bool cached_overview = !cached.overview.isNull() && cached.w == w_ && cached.h == h_ &&
+                           cached.use_byte_classes == use_byte_classes_ && cached.use_hilbert_curve == use_hilbert_curve_;
+
+    QImage img;
+    if (cached_overview) {
+        img = cached.overview;
+    } else {
+        img = render_overview(dat_, len_, w_, h_, use_byte_classes_, use_hilbert_curve_, opts_,
+                              [this](const QImage &partial) {
+                                  // The image is still being written, so a deep copy is sent
+                                  if (report_due()) emit overviewProgress(gen_, partial.copy());
+                                  return !cancel_;
+                              });
+        if (cancel_) return;
+    }
+    emit overviewProgress(gen_, img);
+
+    summary_.overview = img;
+    summary_.w = w_;
+    summary_.h = h_;
+    summary_.use_byte_classes = use_byte_classes_;
+    summary_.use_hilbert_curve = use_hilbert_curve_;
+    summary_.start = start_;
+    summary_.end = end_;
+
+    {
+        entropy_pyramid_t pyramid;
+
+        if (cached.pyramid.isValid()) {
+            pyramid = std::move(cached.pyramid);
+        } else {
+            calc_opts_t opts = opts_;
+            // The finest level is shown as it fills, when it is what the range would show anyway
+            if (start_ == 0 && end_ == len_) {
+                opts.progress = [&](long done) {
+                    if (!report_due()) return;
+                    // Entries are complete once all of their bytes have been processed. The level is still being
+                    // written, so only a copy of the completed prefix is sent.
+                    const std::vector<block_stats_t> &l = pyramid.levels[0];
+                    long valid = min(long(l.size()), done / pyramid.block);
+                    QVector<float> dd(int(valid));
+                    for (long i = 0; i < valid; i++) dd[i] = l[i].entropy;
+                    emit entropyProgress(gen_, dd, long(l.size()));
+                };
+            }
+            build_entropy_pyramid(pyramid, dat_, len_, 256, opts);
+            if (cancel_) return;
+        }
+
+        std::vector<block_stats_t> stats;
+        read_entropy_pyramid(pyramid, start_, end_, std::numeric_limits<long>::max(), stats);
+        QVector<float> dd(int(stats.size()));
+        for (int i = 0; i < dd.size(); i++) dd[i] = stats[i].entropy;
+        emit entropyProgress(gen_, dd, dd.size());
+        summary_.pyramid = std::move(pyramid);
+    }
+
+    {
+        // The histogram of the range comes from the index, which is built in the same single pass over the file
+        byte_index_t idx;
+        if (cached.index.isValid()) {
+            idx = std::move(cached.index);
+        } else {
+            build_byte_index(idx, dat_, len_, opts_);
+            if (cancel_) return;
+        }
+        auto hist = generate_histo_indexed(idx, dat_, start_, end_);
+        summary_.index = std::move(idx);
+        QVector<float> dd(256);
+        std::copy(hist, hist + 256, dd.begin());
+        delete[] hist;
+        emit histogramReady(gen_, dd);
+        summary_.histogram = dd;
+    }
+
+    // The overview is rewritten when the view has changed size, so the cache follows the latest one
+    if (!cache_path.isEmpty() && !cached_overview) write_summary_cache(cache_path, summary_);
+
+    emit loaded(gen_);
+}
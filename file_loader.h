@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2015, 2017, 2020 Kent A. Vander Velden, kent.vandervelden@gmail.com
+ *
+ * This file is part of BinVis.
+ *
+ *     BinVis is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     BinVis is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with BinVis.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _FILE_LOADER_H_
+#define _FILE_LOADER_H_
+
+#include <atomic>
+
+#include <QImage>
+#include <QString>
+#include <QThread>
+#include <QVector>
+
+#include "histogram_calc.h"
+
+class MappedFile;
+
+/// FileSummary holds the results of a FileLoader, along with the parameters they were computed for.
+struct FileSummary {
+    QImage overview;
+    int w, h;
+    bool use_byte_classes;
+    bool use_hilbert_curve;
+
+    // Range of the file covered by histogram
+    long start, end;
+    QVector<float> histogram;
+    // Block statistics and byte counts of the whole file, for the plots of any range
+    entropy_pyramid_t pyramid;
+    byte_index_t index;
+
+    FileSummary() : w(0), h(0), use_byte_classes(false), use_hilbert_curve(false), start(0), end(0) {}
+
+    bool isValid() const { return !overview.isNull() && !histogram.isEmpty(); }
+
+    long bytes() const;
+};
+
+calc_opts_t stream_opts(const MappedFile &file);
+
+/// FileLoader computes the whole-file overview, entropy pyramid and byte index, and from them the entropy and byte
+/// histogram of a range, on a background thread, reporting partial results as they become available so the views can
+/// paint before the analysis completes.
+/// Every signal carries the generation the loader was started with, letting the receiver discard stale results.
+class FileLoader : public QThread {
+Q_OBJECT
+public:
+    FileLoader(int gen, const unsigned char *dat, long len, long start, long end,
+               int w, int h, bool use_byte_classes, bool use_hilbert_curve,
+               const calc_opts_t &opts, QObject *p = nullptr);
+
+    ~FileLoader() override;
+
+    int generation() const { return gen_; }
+
+    long rangeStart() const { return start_; }
+
+    long rangeEnd() const { return end_; }
+
+    void cancel();
+
+    const FileSummary &summary() const { return summary_; }
+
+    void setReportProgress(bool v) { report_progress_ = v; }
+
+    void setCacheFile(const QString &filename);
+
+signals:
+
+    void overviewProgress(int gen, QImage img);
+
+    void entropyProgress(int gen, QVector<float> dd, long len);
+
+    void histogramReady(int gen, QVector<float> dd);
+
+    void loaded(int gen);
+
+protected:
+    void run() override;
+
+    bool report_due();
+
+    int gen_;
+    const unsigned char *dat_;
+    long len_;
+    long start_;
+    long end_;
+    int w_, h_;
+    bool use_byte_classes_;
+    bool use_hilbert_curve_;
+    calc_opts_t opts_;
+    std::atomic<bool> cancel_;
+    qint64 last_report_;
+    bool report_progress_;
+    // The file analyzed, for the summary cache, or empty if the summary is not cached
+    QString filename_;
+    FileSummary summary_;
+};
+
+#endif
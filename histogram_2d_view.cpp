@@ -23,18 +23,34 @@
 #include <QGridLayout>
 #include <QSpinBox>
 #include <QComboBox>
+#include <QSettings>
 
 #include "histogram_2d_view.h"
 #include "histogram_calc.h"
+#include "result_cache.h"
 
 using std::isnan;
 using std::signbit;
 using std::isinf;
 
+/// Count is a histogram counted by start_count(), along with what it was counted from.
+struct Histogram2dView::Count {
+    std::vector<int> hist;
+    // Fraction of the digrams counted, 1 if exact
+    double frac;
+    const unsigned char *dat;
+    long n;
+    histo_dtype_t dtype;
+    // Digrams counted and the time taken in nanoseconds, for budget_, or 0 if not a full or sampled count
+    long n_counted;
+    double ns;
+};
 
 Histogram2dView::Histogram2dView(QWidget *p)
         : QLabel(p),
-          hist_(nullptr), dat_(nullptr), dat_n_(0) {
+          sample_frac_(1.), hist_dat_(nullptr), hist_n_(0), hist_dtype_(none),
+          budget_(QSettings().value("histogram_budget_ms", 40).toDouble()),
+          dat_(nullptr), dat_n_(0) {
     {
         auto layout = new QGridLayout(this);
         {
@@ -72,21 +88,32 @@ Histogram2dView::Histogram2dView(QWidget *p)
         }
         {
             auto cb = new QComboBox;
-            cb->setFixedSize(cb->sizeHint());
             cb->addItem("U8");
             cb->addItem("U16");
+            cb->addItem("U16BE");
             cb->addItem("U32");
+            cb->addItem("U32BE");
             cb->addItem("U64");
+            cb->addItem("U64BE");
             cb->addItem("F32");
+            cb->addItem("F32BE");
             cb->addItem("F64");
+            cb->addItem("F64BE");
+            cb->setFixedSize(cb->sizeHint());
             cb->setCurrentIndex(0);
             cb->setEditable(false);
             type_ = cb;
             layout->addWidget(cb, 2, 1);
         }
+        {
+            auto l = new QLabel;
+            l->hide();
+            sample_label_ = l;
+            layout->addWidget(l, 3, 0, 1, 3);
+        }
 
         layout->setColumnStretch(2, 1);
-        layout->setRowStretch(3, 1);
+        layout->setRowStretch(4, 1);
 
         QObject::connect(thresh_, SIGNAL(valueChanged(int)), this, SLOT(parameters_changed()));
         QObject::connect(scale_, SIGNAL(valueChanged(int)), this, SLOT(parameters_changed()));
@@ -95,7 +122,7 @@ Histogram2dView::Histogram2dView(QWidget *p)
 }
 
 Histogram2dView::~Histogram2dView() {
-    delete[] hist_;
+    count_.stop();
 }
 
 void Histogram2dView::setImage(QImage &img) {
@@ -132,19 +159,117 @@ void Histogram2dView::update_pix() {
     setPixmap(pix_);
 }
 
-void Histogram2dView::setData(const unsigned char *dat, long n) {
+/// setData shows the histogram of dat once it has been counted, see start_count().
+void Histogram2dView::setData(const unsigned char *dat, long n, const calc_opts_t &opts, const std::string &key) {
     dat_ = dat;
     dat_n_ = n;
+    opts_ = opts;
+    key_ = key;
 
-    regen_histo();
+    start_count(true);
+}
+
+/// resetData forgets the current data, which is about to be unmapped, so the next setData() starts afresh.
+void Histogram2dView::resetData() {
+    count_.stop();
+    dat_ = nullptr;
+    dat_n_ = 0;
+    key_.clear();
+    hist_dat_ = nullptr;
+    hist_n_ = 0;
 }
 
 void Histogram2dView::regen_histo() {
-    delete[] hist_;
-    hist_ = nullptr;
+    start_count(false);
+}
 
+/// start_count counts the histogram of the current data on the thread pool, delivering it to countReady(). If update
+/// and the data is a small move of that of the exact histogram shown, as when the selection is dragged, only the
+/// digrams that left and entered the range are counted. Otherwise, if counting every digram would take longer than
+/// the frame time budget, a sample of them is counted and delivered first. Exact counts are kept in the result cache,
+/// and one found there is shown at once.
+void Histogram2dView::start_count(bool update) {
+    auto slot = std::make_shared<ResultSlot<Count> >();
+    counted_ = slot;
+
+    const unsigned char *dat = dat_;
+    long n = dat_n_;
     histo_dtype_t t = string_to_histo_dtype(type_->currentText().toStdString());
-    hist_ = generate_histo_2d(dat_, dat_n_, t);
+
+    std::string cache_key;
+    if (!key_.empty()) {
+        cache_key = key_ + ":histo_2d:" + type_->currentText().toStdString();
+        auto hist = ResultCache::instance().get<std::vector<int> >(cache_key);
+        if (hist) {
+            count_.cancel();
+            hist_ = *hist;
+            sample_frac_ = 1.;
+            hist_dat_ = dat;
+            hist_n_ = n;
+            hist_dtype_ = t;
+            parameters_changed();
+            return;
+        }
+    }
+    long es = histo_dtype_size(t);
+    long n_tuples = es > 0 ? n / es : 0;
+    long n_samples = budget_.samples(n_tuples);
+
+    // Only an exact histogram can be updated
+    std::shared_ptr<std::vector<int> > base;
+    const unsigned char *old_dat = hist_dat_;
+    long old_n = hist_n_;
+    if (update && sample_frac_ >= 1. && hist_dat_ != nullptr && hist_dtype_ == t) {
+        base = std::make_shared<std::vector<int> >(hist_);
+    }
+
+    count_.run(opts_, [=](const calc_opts_t &opts, int gen) {
+        auto deliver = [&](std::vector<int> &&hist, double frac, long n_counted, double ns) {
+            if (frac >= 1. && !cache_key.empty()) {
+                ResultCache::instance().put(cache_key, std::make_shared<const std::vector<int> >(hist),
+                                            long(hist.size() * sizeof(int)));
+            }
+            slot->put(Count{std::move(hist), frac, dat, n, t, n_counted, ns});
+            QMetaObject::invokeMethod(this, "countReady", Qt::QueuedConnection, Q_ARG(int, gen));
+        };
+
+        if (base && update_histo_2d(base->data(), old_dat, old_n, dat, n, t, opts)) {
+            if (!*opts.cancel) deliver(std::move(*base), 1., 0, 0.);
+            return;
+        }
+
+        QElapsedTimer timer;
+        if (n_samples < n_tuples) {
+            timer.start();
+            double frac;
+            int *hist = generate_histo_2d_sampled(dat, n, t, n_samples, frac);
+            deliver(std::vector<int>(hist, hist + 256 * 256), frac, n_samples, timer.nsecsElapsed());
+            delete[] hist;
+        }
+
+        timer.start();
+        int *hist = generate_histo_2d(dat, n, t, opts);
+        if (!*opts.cancel) deliver(std::vector<int>(hist, hist + 256 * 256), 1., n_tuples, timer.nsecsElapsed());
+        delete[] hist;
+    });
+}
+
+/// countReady shows the latest histogram counted by start_count(), unless the data has changed since it was started.
+void Histogram2dView::countReady(int gen) {
+    Count c;
+    if (!count_.isCurrent(gen) || !counted_ || !counted_->take(c)) return;
+
+    hist_.swap(c.hist);
+    sample_frac_ = c.frac;
+    hist_dat_ = c.dat;
+    hist_n_ = c.n;
+    hist_dtype_ = c.dtype;
+
+    if (c.frac < 1.) {
+        budget_.record_sampled(c.n_counted, c.ns);
+    } else {
+        budget_.record_exact(c.n_counted, c.ns);
+    }
 
     parameters_changed();
 }
@@ -158,7 +283,7 @@ void Histogram2dView::parameters_changed() {
 
     auto p = (unsigned int *) img.bits();
 
-    for (int i = 0; i < 256 * 256; i++, p++) {
+    for (int i = 0; i < int(hist_.size()); i++, p++) {
         if (hist_[i] >= thresh) {
             float cc = hist_[i] / scale_factor;
             cc += .2;
@@ -178,5 +303,15 @@ void Histogram2dView::parameters_changed() {
 
     setImage(img);
 
+    if (sample_frac_ < 1.) {
+        // The error of a bin just at the threshold, the one most likely to be shown or hidden wrongly
+        sample_label_->setText(QString("Sampled %1%, +/-%2% at threshold")
+                                       .arg(sample_frac_ * 100., 0, 'g', 2)
+                                       .arg(sampled_relative_error(sample_frac_, thresh) * 100., 0, 'f', 0));
+        sample_label_->show();
+    } else {
+        sample_label_->hide();
+    }
+
     update();
 }
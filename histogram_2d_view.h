@@ -20,10 +20,17 @@
 #ifndef _HISTOGRAM_2D_VIEW_
 #define _HISTOGRAM_2D_VIEW_
 
+#include <memory>
+#include <string>
+#include <vector>
+
 #include <QLabel>
 #include <QImage>
 #include <QPixmap>
 
+#include "compute_scheduler.h"
+#include "histogram_calc.h"
+
 class QSpinBox;
 
 class QComboBox;
@@ -35,9 +42,15 @@ public:
 
     ~Histogram2dView() override;
 
+    /// cpu_ns returns the CPU time spent computing what it shows, in nanoseconds.
+    int64_t cpu_ns() const { return count_.cpu_ns(); }
+
 public slots:
 
-    void setData(const unsigned char *dat, long n);
+    void setData(const unsigned char *dat, long n, const calc_opts_t &opts = calc_opts_t(),
+                 const std::string &key = std::string());
+
+    void resetData();
 
     void parameters_changed();
 
@@ -47,6 +60,8 @@ protected slots:
 
     void regen_histo();
 
+    void countReady(int gen);
+
 protected:
     QImage img_;
     QPixmap pix_;
@@ -57,11 +72,29 @@ protected:
 
     void update_pix();
 
+    void start_count(bool update);
+
+    struct Count;
+
     QSpinBox *thresh_, *scale_;
     QComboBox *type_;
-    int *hist_;
+    QLabel *sample_label_;
+    std::vector<int> hist_;
+    // Fraction of the digrams counted in hist_, 1 once it is exact
+    double sample_frac_;
+    // The data hist_ was counted from
+    const unsigned char *hist_dat_;
+    long hist_n_;
+    histo_dtype_t hist_dtype_;
+    sample_budget_t budget_;
     const unsigned char *dat_;
     long dat_n_;
+    calc_opts_t opts_;
+    // Result cache key of the data, or empty if its results are not to be cached
+    std::string key_;
+    // Counts the histogram of the data on the thread pool, leaving hist_ shown until the count is ready
+    ComputeScheduler count_;
+    std::shared_ptr<ResultSlot<Count> > counted_;
 
 signals:
 
@@ -0,0 +1,201 @@
+/*
+ * Copyright (c) 2015, 2017, 2020 Kent A. Vander Velden, kent.vandervelden@gmail.com
+ *
+ * This file is part of BinVis.
+ *
+ *     BinVis is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     BinVis is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with BinVis.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include <QCommandLineParser>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QGLContext>
+#include <QImage>
+#include <QOffscreenSurface>
+#include <QOpenGLContext>
+#include <QOpenGLFramebufferObject>
+#include <QSet>
+
+#include "histogram_3d_export.h"
+#include "histogram_3d_renderer.h"
+#include "histogram_calc.h"
+#include "mapped_file.h"
+#include "thread_pool.h"
+
+/// angle_t is a camera angle to export: rotations about the vertical and a diagonal axis, in degrees, as the spin of
+/// a Histogram3dView.
+struct angle_t {
+    float alpha, alpha2;
+    QString name;
+};
+
+/// parse_angles parses a comma separated list of alpha[:alpha2] into angles, returning whether all were valid.
+static bool parse_angles(const QString &s, std::vector<angle_t> &angles) {
+    for (const QString &a : s.split(',', QString::SkipEmptyParts)) {
+        QStringList parts = a.split(':');
+        bool ok1 = true, ok2 = true;
+        angle_t angle{parts[0].toFloat(&ok1), parts.size() > 1 ? parts[1].toFloat(&ok2) : 0.f, a.trimmed()};
+        if (!ok1 || !ok2 || parts.size() > 2) return false;
+        angle.name.replace(':', '_');
+        angles.push_back(angle);
+    }
+    return !angles.empty();
+}
+
+/// export_3d_images renders the 3D histogram of each file named in args to a PNG image per camera angle, without a
+/// window, as for a batch job over many samples. Drawing uses a framebuffer object in an offscreen context and the
+/// same Histogram3dRenderer as the view, so it works on any platform offering OpenGL, e.g. with Mesa:
+///     binary_viewer -platform offscreen --export-3d --out shots --angles 0,45,90:30 samples/*
+/// Each image is written to the output directory as <file name>_3d_<angle>.png, the file name followed by -2, -3, ...
+/// if an earlier file of the batch has the same name. The throughput is printed at the end.
+/// @param [in] args The arguments following --export-3d.
+/// @return The exit status: failure if any file was not a regular file or could not be read, or any image written.
+int export_3d_images(const QStringList &args) {
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Export 3D trigram histograms as PNG images, without a window.");
+    parser.addHelpOption();
+    QCommandLineOption out_opt("out", "Directory the images are written to.", "dir", ".");
+    QCommandLineOption angles_opt("angles", "Comma separated camera angles, each alpha[:alpha2] in degrees.", "list",
+                                  "0");
+    QCommandLineOption size_opt("size", "Width and height of the images in pixels.", "pixels", "512");
+    QCommandLineOption thresh_opt("threshold", "Smallest count of a bin shown.", "count", "4");
+    QCommandLineOption scale_opt("scale", "A bin's brightness is 20% plus its count over this.", "count", "100");
+    QCommandLineOption type_opt("type", "Type of the values counted, as in the view.", "type", "U8");
+    QCommandLineOption no_overlap_opt("no-overlap", "Count disjoint rather than overlapping trigrams.");
+    parser.addOptions({out_opt, angles_opt, size_opt, thresh_opt, scale_opt, type_opt, no_overlap_opt});
+    parser.addPositionalArgument("files", "Files to export.", "files...");
+    parser.process(QStringList("binary_viewer --export-3d") + args);
+
+    std::vector<angle_t> angles;
+    if (!parse_angles(parser.value(angles_opt), angles)) {
+        fprintf(stderr, "Invalid angles: %s\n", qPrintable(parser.value(angles_opt)));
+        return EXIT_FAILURE;
+    }
+    int size = std::max(16, parser.value(size_opt).toInt());
+    int thresh = std::max(1, parser.value(thresh_opt).toInt());
+    float scale = std::max(1, parser.value(scale_opt).toInt());
+    histo_dtype_t dtype = string_to_histo_dtype(parser.value(type_opt).toStdString());
+    if (dtype == none) {
+        fprintf(stderr, "Invalid type: %s\n", qPrintable(parser.value(type_opt)));
+        return EXIT_FAILURE;
+    }
+    bool overlap = !parser.isSet(no_overlap_opt);
+    QDir out(parser.value(out_opt));
+    if (!out.mkpath(".")) {
+        fprintf(stderr, "Cannot create %s\n", qPrintable(out.path()));
+        return EXIT_FAILURE;
+    }
+
+    QSurfaceFormat format;
+    format.setDepthBufferSize(24);
+    QOpenGLContext context;
+    context.setFormat(format);
+    QOffscreenSurface surface;
+    surface.setFormat(format);
+    surface.create();
+    if (!context.create() || !context.makeCurrent(&surface)) {
+        fprintf(stderr, "Cannot create an OpenGL context\n");
+        return EXIT_FAILURE;
+    }
+
+    int rv = EXIT_SUCCESS;
+    {
+        QOpenGLFramebufferObject fbo(size, size, QOpenGLFramebufferObject::Depth);
+        fbo.bind();
+
+        Histogram3dRenderer renderer;
+        renderer.initialize(QGLContext::currentContext());
+        renderer.resize(size, size);
+
+        long n_files = 0, n_images = 0;
+        double count_ns = 0., render_ns = 0., write_ns = 0.;
+        QElapsedTimer total;
+        total.start();
+        QSet<QString> bases;
+        for (const QString &fn : parser.positionalArguments()) {
+            // Directories and devices would be read as empty or endless streams
+            if (!QFileInfo(fn).isFile()) {
+                fprintf(stderr, "Skipping %s, not a regular file\n", qPrintable(fn));
+                rv = EXIT_FAILURE;
+                continue;
+            }
+
+            QElapsedTimer timer;
+            timer.start();
+            MappedFile file;
+            if (!file.open(fn.toStdString())) {
+                fprintf(stderr, "Cannot read %s\n", qPrintable(fn));
+                rv = EXIT_FAILURE;
+                continue;
+            }
+            file.advise(MappedFile::sequential);
+
+            sparse_histo_t hist;
+            generate_histo_3d_sparse(hist, file.data(), file.size(), dtype, overlap);
+            Histogram3dRenderer::Points pts;
+            Histogram3dRenderer::build_points(pts, hist);
+            renderer.set_points(pts);
+            const Histogram3dRenderer::lod_t *lod = renderer.lod_to_draw(thresh, -1);
+            count_ns += timer.nsecsElapsed();
+            n_files++;
+
+            // The background is cleared to transparent black, and shown black as by the view once alpha is dropped
+            timer.start();
+            std::vector<QImage> imgs;
+            for (const auto &angle : angles) {
+                renderer.paint(angle.alpha, angle.alpha2, thresh, scale, lod);
+                imgs.push_back(fbo.toImage().convertToFormat(QImage::Format_RGB32));
+            }
+            render_ns += timer.nsecsElapsed();
+
+            // Encoding takes several times longer than drawing, so the images are encoded in parallel
+            timer.start();
+            QString name = QFileInfo(fn).fileName();
+            QString base = name;
+            for (int i = 2; bases.contains(base); i++) base = QString("%1-%2").arg(name).arg(i);
+            bases.insert(base);
+            std::vector<char> written(angles.size());
+            ThreadPool::instance().parallel_for(long(angles.size()), [&](long k) {
+                written[k] = imgs[k].save(out.filePath(QString("%1_3d_%2.png").arg(base, angles[k].name)), "PNG");
+            });
+            for (size_t k = 0; k < angles.size(); k++) {
+                if (!written[k]) {
+                    fprintf(stderr, "Cannot write %s_3d_%s.png\n", qPrintable(base), qPrintable(angles[k].name));
+                    rv = EXIT_FAILURE;
+                }
+            }
+            write_ns += timer.nsecsElapsed();
+            n_images += long(angles.size());
+        }
+
+        double s = total.nsecsElapsed() / 1e9;
+        printf("%ld images in %.2f s, %.1f images/s\n", n_images, s, n_images / std::max(s, 1e-9));
+        if (n_images > 0) {
+            printf("histogram and points %.1f ms per file, render %.1f ms and PNG %.1f ms per image\n",
+                   count_ns / n_files / 1e6, render_ns / n_images / 1e6, write_ns / n_images / 1e6);
+        }
+
+        renderer.destroy();
+        fbo.release();
+    }
+    context.doneCurrent();
+
+    return rv;
+}
@@ -0,0 +1,310 @@
+/*
+ * Copyright (c) 2015, 2017, 2020 Kent A. Vander Velden, kent.vandervelden@gmail.com
+ *
+ * This file is part of BinVis.
+ *
+ *     BinVis is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     BinVis is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with BinVis.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+
+#include <QGLShaderProgram>
+
+#include <GL/glut.h>
+
+#include "histogram_3d_renderer.h"
+
+// Bins packed between polls of the cancellation flag when building points
+static const long points_poll = 1L << 20;
+
+// The coarsest level of detail has voxels of 16^3 bins, 4096 points at most
+static const int lod_max_shift = 4;
+
+// The bin coordinates arrive normalized to [0, 1]. GLSL 1.20 with the fixed function matrices runs on any OpenGL 2.1
+// implementation, including Mesa's llvmpipe.
+static const char *points_vertex_shader =
+        "#version 120\n"
+        "attribute vec3 bin;\n"
+        "attribute float count;\n"
+        "uniform float scale;\n"
+        "void main() {\n"
+        "    gl_Position = gl_ModelViewProjectionMatrix * vec4(bin * 2. - 1., 1.);\n"
+        "    float c = min(count / scale + .2, 1.);\n"
+        "    gl_FrontColor = vec4(c, c, c, 1.);\n"
+        "}\n";
+
+static const char *points_fragment_shader =
+        "#version 120\n"
+        "void main() {\n"
+        "    gl_FragColor = gl_Color;\n"
+        "}\n";
+
+/// box_vertices returns the edges of the bounding cube and the axes at its origin, as pairs of points, followed by
+/// their colours.
+static std::vector<GLfloat> box_vertices() {
+    // Start at <-1, -1, -1>, and flip the sign on one dimension to produce a new unique point, continue until all paths terminate at <1,1,1>
+    GLfloat lines_vertices[] = {
+            -1, -1, -1, 1, -1, -1,
+            -1, -1, -1, -1, 1, -1,
+            -1, -1, -1, -1, -1, 1,
+
+            1, -1, -1, 1, 1, -1,
+            1, -1, -1, 1, -1, 1,
+
+            -1, 1, -1, 1, 1, -1,
+            -1, 1, -1, -1, 1, 1,
+
+            -1, -1, 1, 1, -1, 1,
+            -1, -1, 1, -1, 1, 1,
+
+            -1, 1, 1, 1, 1, 1,
+            1, -1, 1, 1, 1, 1,
+            1, 1, -1, 1, 1, 1,
+
+            -1.05, -1.05, -1.05, -1 + .05, -1 - .05, -1 - .05,
+            -1.05, -1.05, -1.05, -1 - .05, -1 + .05, -1 - .05,
+            -1.05, -1.05, -1.05, -1 - .05, -1 - .05, -1 + .05
+    };
+
+    // slightly offset the edges from the data
+    for (int i = 0; i < 24 * 3; i++) {
+        if (lines_vertices[i] < 0) { lines_vertices[i] -= .01; }
+        if (lines_vertices[i] > 0) { lines_vertices[i] += .01; }
+    }
+
+    GLfloat lines_colors[] = {
+            .2, .2, .2, .2, .2, .2,
+            .2, .2, .2, .2, .2, .2,
+            .2, .2, .2, .2, .2, .2,
+
+            .2, .2, .2, .2, .2, .2,
+            .2, .2, .2, .2, .2, .2,
+
+            .2, .2, .2, .2, .2, .2,
+            .2, .2, .2, .2, .2, .2,
+
+            .2, .2, .2, .2, .2, .2,
+            .2, .2, .2, .2, .2, .2,
+
+            .2, .2, .2, .2, .2, .2,
+            .2, .2, .2, .2, .2, .2,
+            .2, .2, .2, .2, .2, .2,
+
+            .4, .4, .4, .4, .4, .4,
+            .4, .4, .4, .4, .4, .4,
+            .4, .4, .4, .4, .4, .4
+    };
+
+    std::vector<GLfloat> rv(std::begin(lines_vertices), std::end(lines_vertices));
+    rv.insert(rv.end(), std::begin(lines_colors), std::end(lines_colors));
+    return rv;
+}
+
+// Number of points in box_vertices()
+static const int box_n = 24 + 6;
+
+Histogram3dRenderer::Histogram3dRenderer() : program_(nullptr), n_points_(0), height_(1) {}
+
+/// The buffers and program must have been released by destroy(), while their context was current.
+Histogram3dRenderer::~Histogram3dRenderer() = default;
+
+/// build_points packs the occupied bins of hist into points, as done on the thread pool once per histogram, whatever
+/// the threshold and scale: sorted by decreasing count, the points of any threshold are a prefix of them, found by
+/// points_shown(). Coarser levels of detail, each merging the bins of the one before into voxels twice as large,
+/// follow the full detail.
+/// @param [out] pts The points.
+/// @param [in] hist The histogram, as from generate_histo_3d_sparse().
+/// @param [in] cancel Polled now and then, the points being abandoned once it is set, or nullptr.
+/// @return Whether the points were built, rather than cancelled.
+bool Histogram3dRenderer::build_points(Points &pts, const sparse_histo_t &hist, const std::atomic<bool> *cancel) {
+    pts.pts.clear();
+    pts.lods.clear();
+
+    sparse_histo_t level(hist);
+    for (int shift = 0; shift <= lod_max_shift; shift++) {
+        if (shift > 0) {
+            sparse_histo_t coarse;
+            coarsen_sparse(coarse, level, shift);
+            level.swap(coarse);
+        }
+        sort_sparse_by_count(level);
+        if (cancel && *cancel) return false;
+
+        lod_t lod;
+        lod.shift = shift;
+        lod.first = int(pts.pts.size());
+        pts.pts.resize(pts.pts.size() + level.size());
+        for (long k = 0; k < long(level.size()); k++) {
+            if (k % points_poll == 0 && cancel && *cancel) return false;
+
+            const sparse_bin_t &b = level[k];
+            point_t &pt = pts.pts[lod.first + k];
+            pt.x = GLubyte(b.bin / (256 * 256));
+            pt.y = GLubyte((b.bin % (256 * 256)) / 256);
+            pt.z = GLubyte(b.bin % 256);
+            pt.pad = 0;
+            pt.count = GLfloat(b.count);
+
+            if (lod.levels.empty() || lod.levels.back() != b.count) {
+                lod.levels.push_back(b.count);
+                lod.ends.push_back(0);
+            }
+            lod.ends.back() = int(k + 1);
+        }
+        pts.lods.push_back(std::move(lod));
+    }
+
+    return true;
+}
+
+/// initialize builds the shader and buffers in the current context, which is context.
+void Histogram3dRenderer::initialize(const QGLContext *context) {
+    glClearColor(0, 0, 0, 0);
+    glEnable(GL_DEPTH_TEST);
+
+    program_ = new QGLShaderProgram(context);
+    if (!program_->addShaderFromSourceCode(QGLShader::Vertex, points_vertex_shader) ||
+        !program_->addShaderFromSourceCode(QGLShader::Fragment, points_fragment_shader) ||
+        !program_->link()) {
+        qWarning("Histogram3dRenderer: cannot build the point shader: %s", qPrintable(program_->log()));
+        delete program_;
+        program_ = nullptr;
+    }
+
+    // The box never changes, so it is uploaded once
+    std::vector<GLfloat> box = box_vertices();
+    box_buf_.create();
+    box_buf_.bind();
+    box_buf_.allocate(box.data(), int(box.size() * sizeof(box[0])));
+    box_buf_.release();
+
+    points_buf_.create();
+}
+
+/// destroy releases the shader and buffers, which belong to the current context.
+void Histogram3dRenderer::destroy() {
+    points_buf_.destroy();
+    box_buf_.destroy();
+    delete program_;
+    program_ = nullptr;
+    n_points_ = 0;
+    lods_.clear();
+}
+
+/// resize sets the viewport and projection for a w by h drawing area.
+void Histogram3dRenderer::resize(int w, int h) {
+    height_ = std::max(h, 1);
+
+    glMatrixMode(GL_PROJECTION);
+
+    glLoadIdentity();
+    gluPerspective(20, w / (float) height_, 5, 15);
+    glViewport(0, 0, w, h);
+
+    glMatrixMode(GL_MODELVIEW);
+}
+
+/// set_points uploads pts, as built by build_points(), to the point buffer, leaving pts empty.
+void Histogram3dRenderer::set_points(Points &pts) {
+    points_buf_.bind();
+    points_buf_.allocate(pts.pts.data(), int(pts.pts.size() * sizeof(point_t)));
+    points_buf_.release();
+    n_points_ = int(pts.pts.size());
+    std::vector<point_t>().swap(pts.pts);
+
+    lods_.swap(pts.lods);
+    pts.lods.clear();
+}
+
+/// lod_to_draw returns the level of detail to draw, or nullptr if there are no points: the finest whose points at
+/// thresh fit within budget, or the full detail if budget is negative.
+const Histogram3dRenderer::lod_t *Histogram3dRenderer::lod_to_draw(int thresh, long budget) const {
+    if (lods_.empty()) return nullptr;
+    if (budget < 0) return &lods_.front();
+
+    for (const auto &lod : lods_) {
+        if (points_shown(lod, thresh) <= budget) return &lod;
+    }
+    return &lods_.back();
+}
+
+/// points_shown returns the number of points of lod at or above thresh, which lead its points.
+int Histogram3dRenderer::points_shown(const lod_t &lod, int thresh) const {
+    // The first level below the threshold ends the points shown
+    auto it = std::partition_point(lod.levels.begin(), lod.levels.end(), [=](int c) { return c >= thresh; });
+    return it == lod.levels.begin() ? 0 : lod.ends[it - lod.levels.begin() - 1];
+}
+
+/// paint draws the box and the points at or above thresh of lod, as returned by lod_to_draw(), rotated by alpha
+/// about the vertical axis and alpha2 about a diagonal one, in degrees. The scale is applied by the vertex shader.
+/// @return The number of points drawn.
+int Histogram3dRenderer::paint(float alpha, float alpha2, int thresh, float scale, const lod_t *lod) {
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    glLoadIdentity();
+
+    glTranslatef(0, 0, -10);
+    glRotatef(30, 1, 0, 0);
+    glRotatef(alpha, 0, 1, 0);
+    glRotatef(alpha2, 1, 0, 1);
+
+    {
+        box_buf_.bind();
+        glEnableClientState(GL_VERTEX_ARRAY);
+        glEnableClientState(GL_COLOR_ARRAY);
+        glVertexPointer(3, GL_FLOAT, 0, nullptr);
+        glColorPointer(3, GL_FLOAT, 0, (const GLvoid *) (box_n * 3 * sizeof(GLfloat)));
+
+        glDrawArrays(GL_LINES, 0, box_n);
+
+        glDisableClientState(GL_COLOR_ARRAY);
+        glDisableClientState(GL_VERTEX_ARRAY);
+        box_buf_.release();
+    }
+
+    int n_shown = lod ? std::min(points_shown(*lod, thresh), n_points_ - lod->first) : 0;
+    if (program_ && n_shown > 0) {
+        // The exact level is drawn with single pixels. A coarser voxel covers about as many pixels as the bins merged
+        // into it: the cube's 256 bins span 2 of the 2 * 10 * tan(10 degrees) units visible vertically at its distance.
+        if (lod->shift > 0) {
+            constexpr double pi = 3.14159265358979323846;
+            float bin_pixels = float(height_ / (256. * 10. * tan(10. * pi / 180.)));
+            glPointSize(std::max(1.f, (1 << lod->shift) * bin_pixels));
+        } else {
+            glPointSize(1.);
+        }
+
+        program_->bind();
+        program_->setUniformValue("scale", GLfloat(scale));
+
+        points_buf_.bind();
+        int bin = program_->attributeLocation("bin");
+        int count = program_->attributeLocation("count");
+        program_->enableAttributeArray(bin);
+        program_->enableAttributeArray(count);
+        program_->setAttributeBuffer(bin, GL_UNSIGNED_BYTE, offsetof(point_t, x), 3, sizeof(point_t));
+        program_->setAttributeBuffer(count, GL_FLOAT, offsetof(point_t, count), 1, sizeof(point_t));
+
+        glDrawArrays(GL_POINTS, lod->first, n_shown);
+
+        program_->disableAttributeArray(count);
+        program_->disableAttributeArray(bin);
+        points_buf_.release();
+        program_->release();
+        glPointSize(1.);
+    }
+
+    return n_shown;
+}
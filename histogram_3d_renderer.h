@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2015, 2017, 2020 Kent A. Vander Velden, kent.vandervelden@gmail.com
+ *
+ * This file is part of BinVis.
+ *
+ *     BinVis is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     BinVis is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with BinVis.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HISTOGRAM_3D_RENDERER_H_
+#define _HISTOGRAM_3D_RENDERER_H_
+
+#include <atomic>
+#include <vector>
+
+#include <QGLBuffer>
+
+#include "histogram_calc.h"
+
+class QGLContext;
+
+class QGLShaderProgram;
+
+/// Histogram3dRenderer draws a sparse 3d histogram as points within a bounding box, into whatever OpenGL context is
+/// current: a Histogram3dView on screen, or a framebuffer object when exporting images without a window. The points
+/// are built once per histogram by build_points() and kept in a buffer; the threshold, scale and level of detail
+/// only change which of them are drawn, and how.
+class Histogram3dRenderer {
+public:
+    /// point_t is a bin of the histogram as uploaded to the point buffer: its coordinates, and its count, from which
+    /// the vertex shader finds its colour.
+    struct point_t {
+        GLubyte x, y, z, pad;
+        GLfloat count;
+    };
+
+    /// lod_t is a level of detail held in the point buffer: the histogram with its bins merged into voxels 2^shift on
+    /// a side, sorted by decreasing count, from first.
+    struct lod_t {
+        int shift;
+        int first;
+        // Each distinct count, decreasing, and the number of points of the level with at least that count
+        std::vector<int> levels;
+        std::vector<int> ends;
+    };
+
+    /// Points holds the points of the occupied bins, at each level of detail, finest first.
+    struct Points {
+        std::vector<point_t> pts;
+        std::vector<lod_t> lods;
+    };
+
+    Histogram3dRenderer();
+
+    ~Histogram3dRenderer();
+
+    Histogram3dRenderer(const Histogram3dRenderer &) = delete;
+
+    Histogram3dRenderer &operator=(const Histogram3dRenderer &) = delete;
+
+    static bool build_points(Points &pts, const sparse_histo_t &hist, const std::atomic<bool> *cancel = nullptr);
+
+    void initialize(const QGLContext *context);
+
+    void destroy();
+
+    void resize(int w, int h);
+
+    void set_points(Points &pts);
+
+    const lod_t *lod_to_draw(int thresh, long budget) const;
+
+    int points_shown(const lod_t &lod, int thresh) const;
+
+    int paint(float alpha, float alpha2, int thresh, float scale, const lod_t *lod);
+
+protected:
+    // The shader applying the scale, or nullptr if it could not be built
+    QGLShaderProgram *program_;
+    QGLBuffer points_buf_;
+    QGLBuffer box_buf_;
+    // Points in points_buf_, and its levels of detail, finest first
+    int n_points_;
+    std::vector<lod_t> lods_;
+    int height_;
+};
+
+#endif
@@ -17,36 +17,56 @@
  *     along with BinVis.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
 #include <cfloat>
+#include <cmath>
 #include <QtGui>
 #include <QGridLayout>
 #include <QLabel>
 #include <QSpinBox>
 #include <QComboBox>
 #include <QCheckBox>
+#include <QSettings>
 
 #include <GL/glut.h>
 
 #include "histogram_calc.h"
 #include "histogram_3d_view.h"
+#include "result_cache.h"
+#include "thread_pool.h"
 
 using std::isnan;
 using std::signbit;
 using std::isinf;
 
 
-static float alpha = 0;
-static float alpha2 = 0;
-
-static GLfloat *vertices = nullptr;
-static GLfloat *colors = nullptr;
-int n_vertices = 0;
+/// Count is a histogram counted by start_count(), along with what it was counted from.
+struct Histogram3dView::Count {
+    std::shared_ptr<const sparse_histo_t> hist;
+    // Fraction of the trigrams counted, 1 if exact
+    double frac;
+    const unsigned char *dat;
+    long n;
+    histo_dtype_t dtype;
+    bool overlap;
+    // Trigrams counted and the time taken in nanoseconds, for budget_, or 0 if not a full or sampled count
+    long n_counted;
+    double ns;
+};
 
 Histogram3dView::Histogram3dView(QWidget *p)
-        : QGLWidget(p), hist_(nullptr), dat_(nullptr), dat_n_(0), spinning_(true) {
-    auto update_timer = new QTimer(this);
-    QObject::connect(update_timer, SIGNAL(timeout()), this, SLOT(updateGL())); //, Qt::QueuedConnection);
-    update_timer->start(100);
+        : QGLWidget(p), hist_(std::make_shared<sparse_histo_t>()), sample_frac_(1.),
+          hist_dat_(nullptr), hist_n_(0), hist_dtype_(none), hist_overlap_(true),
+          // Trigrams are counted into a 64 MB table, several times the cost of a digram
+          budget_(QSettings().value("histogram_budget_ms", 40).toDouble(), 8.),
+          dat_(nullptr), dat_n_(0),
+          point_budget_(QSettings().value("histogram_3d_point_budget", 250000).toLongLong()), points_pending_(false),
+          alpha_(0.), alpha2_(0.), spinning_(true),
+          frame_interval_ms_(1000 / std::max(1, QSettings().value("histogram_3d_fps", 10).toInt())),
+          frame_ms_(0.), paint_cpu_ns_(0) {
+    frame_timer_ = new QTimer(this);
+    frame_timer_->setSingleShot(true);
+    QObject::connect(frame_timer_, SIGNAL(timeout()), this, SLOT(updateGL()));
 
     auto layout = new QGridLayout(this);
     int r = 0;
@@ -89,14 +109,19 @@ Histogram3dView::Histogram3dView(QWidget *p)
     }
     {
         auto cb = new QComboBox;
-        cb->setFixedSize(cb->sizeHint());
         cb->addItem("U8");
         cb->addItem("U12");
         cb->addItem("U16");
+        cb->addItem("U16BE");
         cb->addItem("U32");
+        cb->addItem("U32BE");
         cb->addItem("U64");
+        cb->addItem("U64BE");
         cb->addItem("F32");
+        cb->addItem("F32BE");
         cb->addItem("F64");
+        cb->addItem("F64BE");
+        cb->setFixedSize(cb->sizeHint());
         cb->setCurrentIndex(0);
         cb->setEditable(false);
         type_ = cb;
@@ -118,6 +143,21 @@ Histogram3dView::Histogram3dView(QWidget *p)
     }
     r++;
 
+    {
+        auto l = new QLabel;
+        l->hide();
+        sample_label_ = l;
+        layout->addWidget(l, r, 0, 1, 3);
+    }
+    r++;
+
+    {
+        auto l = new QLabel;
+        frame_label_ = l;
+        layout->addWidget(l, r, 0, 1, 3);
+    }
+    r++;
+
     layout->setColumnStretch(2, 1);
     layout->setRowStretch(r, 1);
 
@@ -128,182 +168,251 @@ Histogram3dView::Histogram3dView(QWidget *p)
 }
 
 Histogram3dView::~Histogram3dView() {
-    delete[] hist_;
-    delete[] vertices;
-    delete[] colors;
+    count_.stop();
+    build_.stop();
+
+    // The buffers and program belong to this widget's context
+    makeCurrent();
+    renderer_.destroy();
+}
+
+/// cpu_ns returns the CPU time spent counting the histograms, building their points and painting them, in
+/// nanoseconds.
+int64_t Histogram3dView::cpu_ns() const {
+    return count_.cpu_ns() + build_.cpu_ns() + paint_cpu_ns_;
 }
 
-void Histogram3dView::setData(const unsigned char *dat, long n) {
+/// setData shows the histogram of dat once it has been counted, see start_count().
+void Histogram3dView::setData(const unsigned char *dat, long n, const calc_opts_t &opts, const std::string &key) {
     dat_ = dat;
     dat_n_ = n;
+    opts_ = opts;
+    key_ = key;
 
-    regen_histo();
+    start_count(true);
 }
 
-void Histogram3dView::initializeGL() {
-    glClearColor(0, 0, 0, 0);
-    glEnable(GL_DEPTH_TEST);
+/// resetData forgets the current data, which is about to be unmapped, so the next setData() starts afresh.
+void Histogram3dView::resetData() {
+    count_.stop();
+    dat_ = nullptr;
+    dat_n_ = 0;
+    key_.clear();
+    hist_dat_ = nullptr;
+    hist_n_ = 0;
 }
 
-void Histogram3dView::resizeGL(int /*w*/, int /*h*/) {
-    glMatrixMode(GL_PROJECTION);
-
-    glLoadIdentity();
-    gluPerspective(20, width() / (float) height(), 5, 15);
-    glViewport(0, 0, width(), height());
+void Histogram3dView::initializeGL() {
+    renderer_.initialize(context());
+}
 
-    glMatrixMode(GL_MODELVIEW);
+void Histogram3dView::resizeGL(int w, int h) {
+    renderer_.resize(w, h);
 }
 
+/// paintGL draws the histogram, uploading its points only when they have been rebuilt. While spinning, a level of
+/// detail within the point budget is drawn, and the next frame is then scheduled, see schedule_frame(); otherwise the
+/// full detail is drawn. The time taken is shown below the controls.
 void Histogram3dView::paintGL() {
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    glLoadIdentity();
-
-    glTranslatef(0, 0, -10);
-    glRotatef(30, 1, 0, 0);
-    glRotatef(alpha, 0, 1, 0);
-    glRotatef(alpha2, 1, 0, 1);
-
-    glEnableClientState(GL_VERTEX_ARRAY);
-    glEnableClientState(GL_COLOR_ARRAY);
-    if (1) {
-        // Start at <-1, -1, -1>, and flip the sign on one dimension to produce a new unique point, continue until all paths terminate at <1,1,1>
-        GLfloat lines_vertices[] = {
-                -1, -1, -1, 1, -1, -1,
-                -1, -1, -1, -1, 1, -1,
-                -1, -1, -1, -1, -1, 1,
-
-                1, -1, -1, 1, 1, -1,
-                1, -1, -1, 1, -1, 1,
-
-                -1, 1, -1, 1, 1, -1,
-                -1, 1, -1, -1, 1, 1,
-
-                -1, -1, 1, 1, -1, 1,
-                -1, -1, 1, -1, 1, 1,
-
-                -1, 1, 1, 1, 1, 1,
-                1, -1, 1, 1, 1, 1,
-                1, 1, -1, 1, 1, 1,
-
-                -1.05, -1.05, -1.05, -1 + .05, -1 - .05, -1 - .05,
-                -1.05, -1.05, -1.05, -1 - .05, -1 + .05, -1 - .05,
-                -1.05, -1.05, -1.05, -1 - .05, -1 - .05, -1 + .05
-        };
+    QElapsedTimer timer;
+    timer.start();
+    int64_t cpu = process_cpu_ns();
+
+    if (points_pending_) {
+        renderer_.set_points(points_);
+        points_pending_ = false;
+    }
 
-        // slightly offset the edges from the data
-        for (int i = 0; i < 24 * 3; i++) {
-            if (lines_vertices[i] < 0) { lines_vertices[i] -= .01; }
-            if (lines_vertices[i] > 0) { lines_vertices[i] += .01; }
+    int thresh = thresh_->value();
+    const Histogram3dRenderer::lod_t *lod = renderer_.lod_to_draw(thresh, spinning_ ? point_budget_ : -1);
+    int n_shown = renderer_.paint(alpha_, alpha2_, thresh, scale_->value(), lod);
+
+    // The spin advances with time rather than per frame, so its speed is the same whatever the frame rate, and
+    // however often the view is redrawn for other reasons
+    if (spinning_) {
+        if (spin_clock_.isValid()) {
+            double s = spin_clock_.restart() / 1000.;
+            alpha_ = alpha_ + 20. * s;
+            alpha2_ = alpha2_ + 2. * s;
+        } else {
+            spin_clock_.start();
         }
+    }
 
-        GLfloat lines_colors[] = {
-                .2, .2, .2, .2, .2, .2,
-                .2, .2, .2, .2, .2, .2,
-                .2, .2, .2, .2, .2, .2,
+    // Wait for the frame, so that its time is that of drawing it rather than of queueing the commands
+    glFinish();
 
-                .2, .2, .2, .2, .2, .2,
-                .2, .2, .2, .2, .2, .2,
+    frame_ms_ = timer.nsecsElapsed() / 1e6;
+    paint_cpu_ns_ += process_cpu_ns() - cpu;
 
-                .2, .2, .2, .2, .2, .2,
-                .2, .2, .2, .2, .2, .2,
+    QString text = QString("Frame %1 ms, %2 points").arg(frame_ms_, 0, 'f', 0).arg(n_shown);
+    if (lod && lod->shift > 0) text += QString(" at 1/%1 detail").arg(1 << lod->shift);
+    frame_label_->setText(text);
 
-                .2, .2, .2, .2, .2, .2,
-                .2, .2, .2, .2, .2, .2,
+    schedule_frame();
+}
 
-                .2, .2, .2, .2, .2, .2,
-                .2, .2, .2, .2, .2, .2,
-                .2, .2, .2, .2, .2, .2,
+/// schedule_frame requests the next frame of the spin, a frame interval after the start of the last, or at once if
+/// that took longer. Nothing is scheduled while the view is still or hidden, so that it then uses no CPU at all.
+void Histogram3dView::schedule_frame() {
+    if (!spinning_ || !isVisible() || frame_timer_->isActive()) return;
 
-                .4, .4, .4, .4, .4, .4,
-                .4, .4, .4, .4, .4, .4,
-                .4, .4, .4, .4, .4, .4
-        };
+    frame_timer_->start(std::max(0, frame_interval_ms_ - int(frame_ms_)));
+}
 
-        glVertexPointer(3, GL_FLOAT, 0, lines_vertices);
-        glColorPointer(3, GL_FLOAT, 0, lines_colors);
+/// n_tuples returns the number of trigrams of the current data.
+long Histogram3dView::n_tuples() const {
+    long es = histo_dtype_size(string_to_histo_dtype(type_->currentText().toStdString()));
+    if (es == 0) return 0;
 
-        glDrawArrays(GL_LINES, 0, 24 + 6);
-    }
+    return dat_n_ / es / (overlap_->isChecked() ? 1 : 3);
+}
 
-    {
-        if (vertices) {
-            glVertexPointer(3, GL_FLOAT, 0, vertices);
-            glColorPointer(3, GL_FLOAT, 0, colors);
+void Histogram3dView::regen_histo() {
+    start_count(false);
+}
 
-            glDrawArrays(GL_POINTS, 0, n_vertices);
+/// start_count counts the histogram of the current data on the thread pool, delivering it to countReady(). If update
+/// and the data is a small move of that of the exact histogram shown, as when the selection is dragged, only the
+/// trigrams that left and entered the range are counted. Otherwise, if counting every trigram would take longer than
+/// the frame time budget, a sample of them is counted and delivered first. Exact counts are kept in the result cache,
+/// and one found there is shown at once.
+/// Only the occupied bins are kept, so thresholding costs time in proportion to them rather than to all 16M bins.
+void Histogram3dView::start_count(bool update) {
+    auto slot = std::make_shared<ResultSlot<Count> >();
+    counted_ = slot;
+
+    const unsigned char *dat = dat_;
+    long n = dat_n_;
+    histo_dtype_t t = string_to_histo_dtype(type_->currentText().toStdString());
+    bool overlap = overlap_->isChecked();
+
+    std::string cache_key;
+    if (!key_.empty()) {
+        cache_key = key_ + ":histo_3d:" + type_->currentText().toStdString() + (overlap ? ":overlap" : "");
+        auto hist = ResultCache::instance().get<sparse_histo_t>(cache_key);
+        if (hist) {
+            count_.cancel();
+            hist_ = hist;
+            sample_frac_ = 1.;
+            hist_dat_ = dat;
+            hist_n_ = n;
+            hist_dtype_ = t;
+            hist_overlap_ = overlap;
+            build_points();
+            parameters_changed();
+            return;
         }
     }
+    long n_all = n_tuples();
+    long n_samples = budget_.samples(n_all);
+
+    // Only an exact histogram can be updated
+    std::shared_ptr<const sparse_histo_t> base;
+    const unsigned char *old_dat = hist_dat_;
+    long old_n = hist_n_;
+    if (update && sample_frac_ >= 1. && hist_dat_ != nullptr && hist_dtype_ == t && hist_overlap_ == overlap) {
+        base = hist_;
+    }
+
+    count_.run(opts_, [=](const calc_opts_t &opts, int gen) {
+        auto deliver = [&](sparse_histo_t &&hist, double frac, long n_counted, double ns) {
+            auto h = std::make_shared<const sparse_histo_t>(std::move(hist));
+            if (frac >= 1. && !cache_key.empty()) {
+                ResultCache::instance().put(cache_key, h, long(h->size() * sizeof(sparse_bin_t)));
+            }
+            slot->put(Count{h, frac, dat, n, t, overlap, n_counted, ns});
+            QMetaObject::invokeMethod(this, "countReady", Qt::QueuedConnection, Q_ARG(int, gen));
+        };
 
-    glDisableClientState(GL_COLOR_ARRAY);
-    glDisableClientState(GL_VERTEX_ARRAY);
+        if (base) {
+            sparse_histo_t hist(*base);
+            if (update_histo_3d_sparse(hist, old_dat, old_n, dat, n, t, overlap, opts)) {
+                if (!*opts.cancel) deliver(std::move(hist), 1., 0, 0.);
+                return;
+            }
+        }
 
-    if (spinning_) {
-        alpha = alpha + 0.1 * 20;
-        alpha2 = alpha2 + 0.01 * 20;
+        QElapsedTimer timer;
+        if (n_samples < n_all) {
+            timer.start();
+            sparse_histo_t hist;
+            double frac;
+            generate_histo_3d_sparse_sampled(hist, dat, n, t, overlap, n_samples, frac);
+            deliver(std::move(hist), frac, n_samples, timer.nsecsElapsed());
+        }
+
+        timer.start();
+        sparse_histo_t hist;
+        generate_histo_3d_sparse(hist, dat, n, t, overlap, opts);
+        if (!*opts.cancel) deliver(std::move(hist), 1., n_all, timer.nsecsElapsed());
+    });
+}
+
+/// countReady shows the latest histogram counted by start_count(), unless the data has changed since it was started.
+void Histogram3dView::countReady(int gen) {
+    Count c;
+    if (!count_.isCurrent(gen) || !counted_ || !counted_->take(c)) return;
+
+    hist_ = c.hist;
+    sample_frac_ = c.frac;
+    hist_dat_ = c.dat;
+    hist_n_ = c.n;
+    hist_dtype_ = c.dtype;
+    hist_overlap_ = c.overlap;
+
+    if (c.frac < 1.) {
+        budget_.record_sampled(c.n_counted, c.ns);
+    } else {
+        budget_.record_exact(c.n_counted, c.ns);
     }
 
-    glFlush();
+    build_points();
+    parameters_changed();
 }
 
-void Histogram3dView::regen_histo() {
-    delete[] hist_;
-    hist_ = nullptr;
+/// pointsReady shows the points built by build_points(), unless the histogram has changed since. They are uploaded
+/// by the next paintGL().
+void Histogram3dView::pointsReady(int gen) {
+    Histogram3dRenderer::Points pts;
+    if (!build_.isCurrent(gen) || !built_ || !built_->take(pts)) return;
 
-    histo_dtype_t t = string_to_histo_dtype(type_->currentText().toStdString());
+    points_ = std::move(pts);
+    points_pending_ = true;
 
-    hist_ = generate_histo_3d(dat_, dat_n_, t, overlap_->isChecked());
+    updateGL();
+}
 
-    parameters_changed();
+/// build_points packs the occupied bins of the histogram into points on the thread pool, delivering them to
+/// pointsReady(). They are built once per histogram, whatever the threshold and scale, see
+/// Histogram3dRenderer::build_points().
+void Histogram3dView::build_points() {
+    auto slot = std::make_shared<ResultSlot<Histogram3dRenderer::Points> >();
+    built_ = slot;
+
+    std::shared_ptr<const sparse_histo_t> hist = hist_;
+    build_.run(calc_opts_t(), [=](const calc_opts_t &opts, int gen) {
+        Histogram3dRenderer::Points pts;
+        if (!Histogram3dRenderer::build_points(pts, *hist, opts.cancel)) return;
+
+        slot->put(std::move(pts));
+        QMetaObject::invokeMethod(this, "pointsReady", Qt::QueuedConnection, Q_ARG(int, gen));
+    });
 }
 
+/// parameters_changed redraws the points with the current threshold and scale. Neither rebuilds the points: the
+/// threshold only changes how many of them are drawn.
 void Histogram3dView::parameters_changed() {
     int thresh = thresh_->value();
-    float scale_factor = scale_->value();
-
-    n_vertices = 0;
-    for (int i = 0; i < 256 * 256 * 256; i++) {
-        if (hist_[i] >= thresh) {
-            n_vertices++;
-        }
-    }
 
-    delete[] vertices;
-    vertices = nullptr;
-    delete[] colors;
-    colors = nullptr;
-
-    if (n_vertices > 0) {
-        vertices = new GLfloat[n_vertices * 3];
-        colors = new GLfloat[n_vertices * 3];
-        for (int i = 0, j = 0; i < 256 * 256 * 256; i++) {
-            if (hist_[i] >= thresh) {
-                float x = i / (256 * 256);
-                float y = (i % (256 * 256)) / 256;
-                float z = i % 256;
-                x = x / 255.;
-                y = y / 255.;
-                z = z / 255.;
-                /*
-                if(x < -1 || x > 1.0 ||
-                   y < -1 || y > 1.0 ||
-                   z < -1 || z > 1.0) {
-                  printf("Warning 3dpc %f %f %f\n", x, y, z);
-                }
-                */
-                vertices[j * 3 + 0] = x * 2. - 1.;
-                vertices[j * 3 + 1] = y * 2. - 1.;
-                vertices[j * 3 + 2] = z * 2. - 1.;
-
-                float cc = hist_[i] / scale_factor;
-                cc += .2;
-                if (cc > 1.) cc = 1.;
-                colors[j * 3 + 0] = cc;
-                colors[j * 3 + 1] = cc;
-                colors[j * 3 + 2] = cc;
-                j++;
-            }
-        }
+    if (sample_frac_ < 1.) {
+        // The error of a bin just at the threshold, the one most likely to be shown or hidden wrongly
+        sample_label_->setText(QString("Sampled %1%, +/-%2% at threshold")
+                                       .arg(sample_frac_ * 100., 0, 'g', 2)
+                                       .arg(sampled_relative_error(sample_frac_, thresh) * 100., 0, 'f', 0));
+        sample_label_->show();
+    } else {
+        sample_label_->hide();
     }
 
     updateGL();
@@ -320,4 +429,27 @@ void Histogram3dView::mouseMoveEvent(QMouseEvent *e) {
 void Histogram3dView::mouseReleaseEvent(QMouseEvent *e) {
     e->accept();
     spinning_ = !spinning_;
+    if (spinning_) {
+        emit animating();
+    } else {
+        frame_timer_->stop();
+        spin_clock_.invalidate();
+    }
+    // Stopping shows the full detail, and starting draws the first frame of the spin
+    updateGL();
+}
+
+void Histogram3dView::showEvent(QShowEvent *e) {
+    QGLWidget::showEvent(e);
+    if (spinning_) {
+        emit animating();
+        schedule_frame();
+    }
+}
+
+/// hideEvent stops the spin until the view is shown again, from where it was left.
+void Histogram3dView::hideEvent(QHideEvent *e) {
+    QGLWidget::hideEvent(e);
+    frame_timer_->stop();
+    spin_clock_.invalidate();
 }
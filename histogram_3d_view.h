@@ -20,14 +20,27 @@
 #ifndef _HISTOGRAM_3D_VIEW_
 #define _HISTOGRAM_3D_VIEW_
 
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <QElapsedTimer>
 #include <QGLWidget>
 
+#include "compute_scheduler.h"
+#include "histogram_3d_renderer.h"
+#include "histogram_calc.h"
+
 class QSpinBox;
 
 class QComboBox;
 
 class QCheckBox;
 
+class QLabel;
+
+class QTimer;
+
 class Histogram3dView : public QGLWidget {
 Q_OBJECT
 public:
@@ -35,9 +48,14 @@ public:
 
     ~Histogram3dView() override;
 
+    int64_t cpu_ns() const;
+
 public slots:
 
-    void setData(const unsigned char *dat, long n);
+    void setData(const unsigned char *dat, long n, const calc_opts_t &opts = calc_opts_t(),
+                 const std::string &key = std::string());
+
+    void resetData();
 
     void parameters_changed();
 
@@ -45,6 +63,15 @@ protected slots:
 
     void regen_histo();
 
+    void countReady(int gen);
+
+    void pointsReady(int gen);
+
+signals:
+
+    /// animating is emitted when the view starts spinning, having been still or hidden.
+    void animating();
+
 protected:
     void initializeGL() override;
 
@@ -58,13 +85,62 @@ protected:
 
     void mouseReleaseEvent(QMouseEvent *event) override;
 
+    void showEvent(QShowEvent *event) override;
+
+    void hideEvent(QHideEvent *event) override;
+
+    void schedule_frame();
+
+    long n_tuples() const;
+
+    void start_count(bool update);
+
+    void build_points();
+
+    struct Count;
+
     QSpinBox *thresh_, *scale_;
     QComboBox *type_;
     QCheckBox *overlap_;
-    int *hist_;
+    QLabel *sample_label_;
+    QLabel *frame_label_;
+    // Shared with the tasks building points from it
+    std::shared_ptr<const sparse_histo_t> hist_;
+    // Fraction of the trigrams counted in hist_, 1 once it is exact
+    double sample_frac_;
+    // The data hist_ was counted from
+    const unsigned char *hist_dat_;
+    long hist_n_;
+    histo_dtype_t hist_dtype_;
+    bool hist_overlap_;
+    sample_budget_t budget_;
     const unsigned char *dat_;
     long dat_n_;
+    calc_opts_t opts_;
+    // Result cache key of the data, or empty if its results are not to be cached
+    std::string key_;
+    // Count the histogram of the data, and pack its points, on the thread pool, leaving the previous points shown
+    // until they are ready
+    ComputeScheduler count_;
+    std::shared_ptr<ResultSlot<Count> > counted_;
+    ComputeScheduler build_;
+    std::shared_ptr<ResultSlot<Histogram3dRenderer::Points> > built_;
+    Histogram3dRenderer renderer_;
+    // Most points drawn per frame while spinning
+    long point_budget_;
+    // Points built but not yet uploaded, by the next paintGL()
+    Histogram3dRenderer::Points points_;
+    bool points_pending_;
+    float alpha_, alpha2_;
     bool spinning_;
+    // Requests the next frame while spinning and shown, leaving the view idle otherwise
+    QTimer *frame_timer_;
+    int frame_interval_ms_;
+    // Time since the spin last advanced, invalid while still or hidden
+    QElapsedTimer spin_clock_;
+    double frame_ms_;
+    // CPU time spent painting, by all threads, as software OpenGL rasterizes on threads of its own
+    int64_t paint_cpu_ns_;
 };
 
 #endif
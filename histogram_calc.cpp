@@ -17,20 +17,27 @@
  *     along with BinVis.  If not, see <https://www.gnu.org/licenses/>.
  */
 
-#include <cfloat>
 #include <cmath>
 #include <algorithm>
 
+#include <condition_variable>
 #include <cstring>
 #include <cstdlib>
+#include <limits>
+#include <mutex>
+#include <type_traits>
+#include <memory>
+#include <vector>
+
+#ifdef _MSC_VER
+#include <stdlib.h>
+#endif
 
 #include "histogram_calc.h"
+#include "thread_pool.h"
 
 using std::min;
 using std::max;
-using std::isinf;
-using std::isnan;
-using std::signbit;
 
 
 /// string_to_histo_dtype returns a histo_dtype_t type corresponding to the type named type.
@@ -46,78 +53,401 @@ histo_dtype_t string_to_histo_dtype(const std::string &s) {
     else if (s == "U64") t = u64;
     else if (s == "F32") t = f32;
     else if (s == "F64") t = f64;
+    else if (s == "U16BE") t = u16be;
+    else if (s == "U32BE") t = u32be;
+    else if (s == "U64BE") t = u64be;
+    else if (s == "F32BE") t = f32be;
+    else if (s == "F64BE") t = f64be;
     else t = none;
 
     return t;
 }
 
 
-template<class T>
-void hist_float_helper_2d(int *hist, T *dat_f, long n) {
-    for (long i = 0; i < n / long(sizeof(T)) - 1; i++) {
-        int a1;
-        int a2;
-        if (sizeof(T) == 4) {
-            a1 = ((dat_f[i + 0] / FLT_MAX) * 255. + 255.) / 2.;
-            a2 = ((dat_f[i + 1] / FLT_MAX) * 255. + 255.) / 2.;
-        } else if (sizeof(T) == 8) {
-            a1 = ((dat_f[i + 0] / DBL_MAX) * 255. + 255.) / 2.;
-            a2 = ((dat_f[i + 1] / DBL_MAX) * 255. + 255.) / 2.;
-        } else {
-            abort();
-        }
+// Bytes processed between polls of opts.cancel when no window size is given
+static const long cancel_window = 16L << 20;
+
+/// for_each_window splits the n_starts tuple starting elements of dat into windows of about opts.window bytes and
+/// calls fn(first, last) for each window's element range. A kernel may read the elements following last, so tuples
+/// spanning a seam are counted exactly once. Each window is handed to opts.release and reported to opts.progress
+/// once fn has returned, and opts.cancel is polled before starting the next; a cancellable kernel is always split
+/// into windows, so that it stops soon after being cancelled.
+/// @param [in] dat Data being analyzed.
+/// @param [in] n_starts Number of elements that start a tuple.
+/// @param [in] es Size of an element in bytes.
+/// @param [in] st Step between tuple starts in elements; windows are aligned to it.
+/// @param [in] opts Window size and release callback.
+/// @param [in] fn The kernel, called with the element range [first, last) of each window.
+template<class F>
+static void for_each_window(const unsigned char *dat, long n_starts, long es, long st, const calc_opts_t &opts, F fn) {
+    long w = n_starts;
+    long window = opts.window > 0 || opts.cancel == nullptr ? opts.window : cancel_window;
+    if (window > 0) {
+        w = max(st, window / es / st * st);
+    }
+
+    for (long i = 0; i < n_starts; i += w) {
+        if (opts.cancel && *opts.cancel) break;
 
-        if (isnan(dat_f[i + 0])) a1 = 255;
-        if (isnan(dat_f[i + 1])) a2 = 255;
+        long e = min(n_starts, i + w);
+        fn(i, e);
+        if (opts.release) opts.release(dat + i * es, (e - i) * es);
+        if (opts.progress) opts.progress(e * es);
+    }
+}
 
-        if (isnan(dat_f[i + 0])) { if (signbit(dat_f[i + 0])) { a1 = 0; } else { a1 = 255; }}
-        if (isnan(dat_f[i + 1])) { if (signbit(dat_f[i + 1])) { a2 = 0; } else { a2 = 255; }}
+/// float_bits_to_bin maps the bits u of a floating point value onto [0, 255] without converting it. The exponent
+/// and the top mantissa bit give the magnitude in half binades; magnitudes from 2^-32 to 2^32 are spread over 128
+/// bins, and smaller and larger ones (zero, denormals, infinities and NaNs included) are clamped to the ends of that
+/// range. Positive values fill bins 128-255 upwards and negative ones mirror them in bins 127-0, so the bins are
+/// ordered like the values. The mapping has no branches or division, so the kernels' inner loops vectorize.
+/// @param [in] u The bits of the value, as an unsigned integer of the same size.
+/// @param [in] mant Number of mantissa bits of the floating point type.
+/// @param [in] bias Exponent bias of the floating point type.
+/// @return The bin of the value.
+template<class U>
+static inline int float_bits_to_bin(U u, int mant, int bias) {
+    const int neg = int(u >> (sizeof(U) * 8 - 1));
+    const int half_binades = int(u >> (mant - 1)) & ((2 << (sizeof(U) * 8 - 1 - mant)) - 1);
 
-        if (isinf(dat_f[i + 0])) { if (signbit(dat_f[i + 0])) { a1 = 0; } else { a1 = 255; }}
-        if (isinf(dat_f[i + 1])) { if (signbit(dat_f[i + 1])) { a2 = 0; } else { a2 = 255; }}
+    int m = half_binades - (bias - 32) * 2;
+    m = min(max(m, 0), 127);
 
-#if 0
-        if(a1 < 0 || a1 > 255) {
-          printf("0 %d %f\n", a1, dat_f[i+0]);
-        }
-        if(a2 < 0 || a2 > 255) {
-          printf("1 %d %f %d %d\n", a2, dat_f[i+1], isnan(dat_f[i+1]), dat_f[i+1] < 0);
-        }
+    return (128 + m) ^ (-neg & 0xff);
+}
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+static const bool host_big_endian = true;
+#else
+static const bool host_big_endian = false;
 #endif
 
-        if (a1 < 0) a1 = 0;
-        if (a2 < 0) a2 = 0;
+#ifdef _MSC_VER
+static inline uint16_t byte_swap(uint16_t v) { return _byteswap_ushort(v); }
+
+static inline uint32_t byte_swap(uint32_t v) { return _byteswap_ulong(v); }
+
+static inline uint64_t byte_swap(uint64_t v) { return _byteswap_uint64(v); }
+#else
+static inline uint16_t byte_swap(uint16_t v) { return __builtin_bswap16(v); }
+
+static inline uint32_t byte_swap(uint32_t v) { return __builtin_bswap32(v); }
+
+static inline uint64_t byte_swap(uint64_t v) { return __builtin_bswap64(v); }
+#endif
+
+/// load_elem returns element i of dat, an unsigned integer of type T stored big-endian if BE, else little-endian.
+/// The element need not be aligned.
+template<class T, bool BE>
+static inline T load_elem(const unsigned char *dat, long i) {
+    T v;
+    memcpy(&v, dat + i * long(sizeof(T)), sizeof(T));
+    return BE != host_big_endian ? byte_swap(v) : v;
+}
+
+// The quantizers map element i of the data, interpreted as a histo_dtype_t, onto the 256 bins of a histogram axis.
+// Each is a separate type, so that the kernels are instantiated for every element type and byte order and their
+// inner loops do not branch on either.
+
+struct quant_u8_t {
+    const unsigned char *d;
+
+    int operator()(long i) const { return d[i]; }
+};
+
+struct quant_u12_t {
+    const unsigned char *d;
+
+    int operator()(long i) const { return (load_elem<uint16_t, false>(d, i) & 0x0fff) >> 4; }
+};
+
+template<class T, bool BE>
+struct quant_uint_t {
+    const unsigned char *d;
 
-        if (a1 > 255) a1 = 255;
-        if (a2 > 255) a2 = 255;
+    int operator()(long i) const { return int(load_elem<T, BE>(d, i) >> (sizeof(T) * 8 - 8)); }
+};
 
-        hist[a1 * 256 + a2]++;
+/// U is the unsigned integer type of the same size as the floating point type T.
+template<class T, class U, bool BE>
+struct quant_float_t {
+    const unsigned char *d;
+
+    int operator()(long i) const {
+        return float_bits_to_bin(load_elem<U, BE>(d, i), std::numeric_limits<T>::digits - 1,
+                                 std::numeric_limits<T>::max_exponent - 1);
+    }
+};
+
+/// dispatch_dtype calls fn(q, es) with the quantizer q and element size es in bytes for dtype, so that kernels are
+/// compiled once per type rather than switching per element.
+template<class F>
+static void dispatch_dtype(const unsigned char *dat_u8, histo_dtype_t dtype, F fn) {
+    switch (dtype) {
+        case none:
+            break;
+        case u8:
+            fn(quant_u8_t{dat_u8}, 1);
+            break;
+        case u12:
+            fn(quant_u12_t{dat_u8}, 2);
+            break;
+        case u16:
+            fn(quant_uint_t<uint16_t, false>{dat_u8}, 2);
+            break;
+        case u32:
+            fn(quant_uint_t<uint32_t, false>{dat_u8}, 4);
+            break;
+        case u64:
+            fn(quant_uint_t<uint64_t, false>{dat_u8}, 8);
+            break;
+        case f32:
+            fn(quant_float_t<float, uint32_t, false>{dat_u8}, 4);
+            break;
+        case f64:
+            fn(quant_float_t<double, uint64_t, false>{dat_u8}, 8);
+            break;
+        case u16be:
+            fn(quant_uint_t<uint16_t, true>{dat_u8}, 2);
+            break;
+        case u32be:
+            fn(quant_uint_t<uint32_t, true>{dat_u8}, 4);
+            break;
+        case u64be:
+            fn(quant_uint_t<uint64_t, true>{dat_u8}, 8);
+            break;
+        case f32be:
+            fn(quant_float_t<float, uint32_t, true>{dat_u8}, 4);
+            break;
+        case f64be:
+            fn(quant_float_t<double, uint64_t, true>{dat_u8}, 8);
+            break;
+    }
+}
+
+/// histo_dtype_size returns the size in bytes of an element of type dtype, or 0 for none.
+long histo_dtype_size(histo_dtype_t dtype) {
+    long rv = 0;
+    dispatch_dtype(nullptr, dtype, [&](auto, long es) { rv = es; });
+
+    return rv;
+}
+
+/// dispatch_stride calls fn(st) with the step between tuple starts, 1 if overlap else 3, as a compile time constant,
+/// so that the loops of the 3d kernels are specialized on it.
+template<class F>
+static void dispatch_stride(bool overlap, F fn) {
+    if (overlap) {
+        fn(std::integral_constant<int, 1>());
+    } else {
+        fn(std::integral_constant<int, 3>());
+    }
+}
+
+// Below this many tuples the cost of starting threads and clearing their private tables outweighs the gain
+static const long min_parallel_n = 1L << 20;
+
+/// histo_2d_kernel counts the digrams starting at the first n_starts elements, spread over the thread pool. Each
+/// thread counts its share of every window into a private 256 KB table, which stays in its cache, and the tables are
+/// summed at the end. A digram spanning the boundary between two threads' shares is counted by the thread owning
+/// its first element.
+template<class Q>
+static void histo_2d_kernel(int *hist, const unsigned char *dat_u8, long n_starts, long es, const calc_opts_t &opts, Q q) {
+    ThreadPool &pool = ThreadPool::instance();
+    int nt = n_starts < min_parallel_n ? 1 : pool.size();
+
+    // thread 0 counts directly into hist
+    std::vector<std::vector<int> > priv(nt - 1);
+
+    for_each_window(dat_u8, n_starts, es, 1, opts, [&](long first, long last) {
+        pool.parallel_for(nt, [&](long t) {
+            long s = first + (last - first) * t / nt;
+            long e = first + (last - first) * (t + 1) / nt;
+
+            int *h = hist;
+            if (t > 0) {
+                if (priv[t - 1].empty()) priv[t - 1].resize(256 * 256, 0);
+                h = priv[t - 1].data();
+            }
+
+            for (long i = s; i < e; i++) {
+                int a1 = q(i + 0);
+                int a2 = q(i + 1);
+
+                h[a1 * 256 + a2]++;
+            }
+        });
+    });
+
+    // Reduce by rows, so that the threads sum disjoint parts of hist
+    pool.parallel_for(nt > 1 ? 256 : 0, [&](long r) {
+        for (const auto &p : priv) {
+            if (p.empty()) continue;
+            for (int j = r * 256; j < (r + 1) * 256; j++) {
+                hist[j] += p[j];
+            }
+        }
+    });
+}
+
+/// count_bytes adds the number of occurrences of each byte value within dat to cnt. The bytes of each 8-byte word are
+/// counted into four tables in turn, so that a run of equal bytes does not wait on the increment of a single counter,
+/// and a word of eight equal bytes is counted with one increment.
+static void count_bytes(const unsigned char *dat, long n, uint64_t *cnt) {
+    // A table counts at most every byte of a chunk, which keeps it within 32 bits
+    static const long chunk = 1L << 30;
+    static const uint64_t ones = 0x0101010101010101ULL;
+
+    uint32_t c[4][256];
+    for (long s = 0; s < n; s += chunk) {
+        long e = min(n, s + chunk);
+        memset(c, 0, sizeof(c));
+
+        long i = s;
+        for (; i + 8 <= e; i += 8) {
+            uint64_t w;
+            memcpy(&w, dat + i, sizeof(w));
+            if (w == (w & 0xff) * ones) {
+                c[0][w & 0xff] += 8;
+                continue;
+            }
+            c[0][w & 0xff]++;
+            c[1][(w >> 8) & 0xff]++;
+            c[2][(w >> 16) & 0xff]++;
+            c[3][(w >> 24) & 0xff]++;
+            c[0][(w >> 32) & 0xff]++;
+            c[1][(w >> 40) & 0xff]++;
+            c[2][(w >> 48) & 0xff]++;
+            c[3][w >> 56]++;
+        }
+        for (; i < e; i++) {
+            c[0][dat[i]]++;
+        }
+
+        for (int b = 0; b < 256; b++) {
+            cnt[b] += uint64_t(c[0][b]) + c[1][b] + c[2][b] + c[3][b];
+        }
+    }
+}
+
+/// normalize_histo scales the 256 entries of hist so that the largest is one.
+static void normalize_histo(float *hist) {
+    float mx = 0.;
+    for (int i = 0; i < 256; i++) {
+        mx = max(mx, hist[i]);
+    }
+    for (int i = 0; i < 256; i++) {
+        hist[i] /= mx;
     }
 }
 
 /// generate_histo computes the histogram for each byte within dat_u8.
 /// @param [in] dat_u8 Byte data to be analyzed.
 /// @param [in] n Length of dat_u8 in bytes
+/// @param [in] opts Controls streaming of dat_u8.
 /// @return The calculated histogram of each byte of dat_u8, as vector of length 256 scaled between [0., 1.]
-float *generate_histo(const unsigned char *dat_u8, long n) { //, histo_dtype_t dtype) {
-    auto hist = new float[256];
-    memset(hist, 0, sizeof(hist[0]) * 256);
-
+float *generate_histo(const unsigned char *dat_u8, long n, const calc_opts_t &opts) { //, histo_dtype_t dtype) {
     //if(dtype != u8) {
     //  abort()
     //}
 
-    for (long i = 0; i < n; i++) {
-        hist[dat_u8[i]]++;
-    }
+    uint64_t cnt[256] = {0};
+    for_each_window(dat_u8, n, 1, 1, opts, [&](long first, long last) {
+        count_bytes(dat_u8 + first, last - first, cnt);
+    });
 
-    float mx = 0.;
+    auto hist = new float[256];
     for (int i = 0; i < 256; i++) {
-        mx = max(mx, hist[i]);
+        hist[i] = float(cnt[i]);
+    }
+    normalize_histo(hist);
+
+    return hist;
+}
+
+// Bounds on the block size of a byte_index_t, which together bound the index to 8 MB
+static const long byte_index_min_block = 64L << 10;
+static const long byte_index_max_blocks = 4096;
+
+/// build_byte_index indexes the byte counts of dat_u8, reading it once.
+/// @param [out] idx The index.
+/// @param [in] dat_u8 Byte data to be indexed.
+/// @param [in] n Length of dat_u8 in bytes.
+/// @param [in] opts Controls streaming of dat_u8. If cancelled, idx is left invalid.
+void build_byte_index(byte_index_t &idx, const unsigned char *dat_u8, long n, const calc_opts_t &opts) {
+    long bs = byte_index_min_block;
+    while (bs * byte_index_max_blocks < n) bs *= 2;
+    long nb = (n + bs - 1) / bs;
+
+    idx.block = bs;
+    idx.n = n;
+    idx.counts.assign((nb + 1) * 256, 0);
+
+    // Count each block into the boundary following it. A block straddling a window seam is counted by two calls.
+    for_each_window(dat_u8, n, 1, 1, opts, [&](long first, long last) {
+        long b0 = first / bs;
+        long b1 = (last - 1) / bs + 1;
+        ThreadPool::instance().parallel_for(b1 - b0, [&](long k) {
+            long b = b0 + k;
+            long s = max(first, b * bs);
+            long e = min(last, (b + 1) * bs);
+            count_bytes(dat_u8 + s, e - s, &idx.counts[(b + 1) * 256]);
+        });
+    });
+    if (opts.cancel && *opts.cancel) {
+        idx = byte_index_t();
+        return;
     }
+
+    for (long b = 1; b <= nb; b++) {
+        uint64_t *c = &idx.counts[b * 256];
+        const uint64_t *p = c - 256;
+        for (int i = 0; i < 256; i++) {
+            c[i] += p[i];
+        }
+    }
+}
+
+/// generate_histo_indexed computes the histogram for each byte within [start, end) of dat_u8, as generate_histo
+/// would, from the difference of the index entries nearest the ends of the range, corrected by scanning the bytes
+/// between each end and its nearest block boundary.
+/// @param [in] idx The index of dat_u8.
+/// @param [in] dat_u8 The indexed data.
+/// @param [in] start Start of the range.
+/// @param [in] end End of the range.
+/// @return The normalized histogram of 256 entries, to be deleted by the caller.
+float *generate_histo_indexed(const byte_index_t &idx, const unsigned char *dat_u8, long start, long end) {
+    long bs = idx.block;
+    long nb = (idx.n + bs - 1) / bs;
+    long b0 = min(nb, (start + bs / 2) / bs);
+    long b1 = min(nb, (end + bs / 2) / bs);
+
+    // Counts to be removed are kept apart, and subtracted once everything has been added
+    uint64_t cnt[256] = {0};
+    uint64_t excess[256] = {0};
+    if (end - start < 2 * bs || b1 <= b0) {
+        count_bytes(dat_u8 + start, end - start, cnt);
+    } else {
+        const uint64_t *c0 = &idx.counts[b0 * 256];
+        const uint64_t *c1 = &idx.counts[b1 * 256];
+        for (int i = 0; i < 256; i++) {
+            cnt[i] = c1[i] - c0[i];
+        }
+
+        // Each end of the range is on either side of its boundary
+        long p0 = min(idx.n, b0 * bs);
+        long p1 = min(idx.n, b1 * bs);
+        if (start < p0) count_bytes(dat_u8 + start, p0 - start, cnt);
+        else count_bytes(dat_u8 + p0, start - p0, excess);
+        if (p1 < end) count_bytes(dat_u8 + p1, end - p1, cnt);
+        else count_bytes(dat_u8 + end, p1 - end, excess);
+    }
+
+    auto hist = new float[256];
     for (int i = 0; i < 256; i++) {
-        hist[i] /= mx;
+        hist[i] = float(cnt[i] - excess[i]);
     }
+    normalize_histo(hist);
 
     return hist;
 }
@@ -126,69 +456,167 @@ float *generate_histo(const unsigned char *dat_u8, long n) { //, histo_dtype_t d
 /// @param [in] dat_u8 Byte data to be analyzed.
 /// @param [in] n Length of dat_u8 in bytes.
 /// @param [in] dtype The type of data to cast dat_u8 as.
+/// @param [in] opts Controls streaming of dat_u8.
 /// @return The 2d histogram, as a linearized matrix of size 256 * 256, containing counts of each digram,
-int *generate_histo_2d(const unsigned char *dat_u8, long n, histo_dtype_t dtype) {
+int *generate_histo_2d(const unsigned char *dat_u8, long n, histo_dtype_t dtype, const calc_opts_t &opts) {
     auto hist = new int[256 * 256];
     memset(hist, 0, sizeof(hist[0]) * 256 * 256);
 
-    switch (dtype) {
-        case none:
-            break;
-        case u8: {
-            for (long i = 0; i < n - 1; i++) {
-                int a1 = dat_u8[i + 0];
-                int a2 = dat_u8[i + 1];
+    dispatch_dtype(dat_u8, dtype, [&](auto q, long es) {
+        histo_2d_kernel(hist, dat_u8, n / es - 1, es, opts, q);
+    });
 
-                hist[a1 * 256 + a2]++;
-            }
-        }
-            break;
-        case u16: {
-            auto dat_u16 = (const unsigned short *) dat_u8;
-            for (long i = 0; i < n / 2 - 1; i++) {
-                int a1 = dat_u16[i + 0] / float(0xffff) * 255.;
-                int a2 = dat_u16[i + 1] / float(0xffff) * 255.;
+#if 0
+    int n_vertices = 0;
+    float m=10000000, M=-1, a=0.;
+    for(int i=0; i<256*256; i++) {
+      if(hist[i] > 0) {
+        n_vertices++;
 
-                hist[a1 * 256 + a2]++;
-            }
-        }
-            break;
-        case u32: {
-            auto dat_u32 = (const unsigned int *) dat_u8;
-            for (long i = 0; i < n / 4 - 1; i++) {
-                int a1 = dat_u32[i + 0] / float(0xffffffff) * 255.;
-                int a2 = dat_u32[i + 1] / float(0xffffffff) * 255.;
+        if(m > hist[i]) m = hist[i];
+        if(M < hist[i]) M = hist[i];
+        a += hist[i];
+      }
+    }
+    a /= n_vertices;
+    printf("%d %f %f %f\n", n_vertices, m, M, a);
+#endif
 
-                hist[a1 * 256 + a2]++;
-            }
+    return hist;
+}
+
+// Bytes scanned by all threads together before moving on, small enough to stay in the shared cache
+static const long histo_3d_block = 1L << 20;
+
+/// leading_bin_bounds splits the leading bins of the trigrams into nt ranges holding about equal numbers of
+/// trigrams, estimated from a sample of the data, so that threads owning a range do similar amounts of work.
+/// @return The nt + 1 boundaries of the ranges, starting at 0 and ending at 256.
+template<class Q>
+static std::vector<int> leading_bin_bounds(long n_starts, int st, int nt, Q q) {
+    std::vector<int> bounds(nt + 1, 256);
+    bounds[0] = 0;
+    if (nt == 1) return bounds;
+
+    long cnt[256] = {0};
+    long step = max(long(st), n_starts / 65536 / st * st);
+    long total = 0;
+    for (long i = 0; i < n_starts; i += step, total++) {
+        cnt[q(i)]++;
+    }
+
+    long acc = 0;
+    int t = 1;
+    for (int b = 0; b < 256 && t < nt; b++) {
+        acc += cnt[b];
+        while (t < nt && acc * nt >= total * t) {
+            bounds[t++] = b + 1;
         }
-            break;
-        case u64: {
-            auto dat_u64 = (const unsigned long *) dat_u8;
-            for (long i = 0; i < n / 8 - 1; i++) {
-                int a1 = dat_u64[i + 0] / float(0xffffffffffffffff) * 255.;
-                int a2 = dat_u64[i + 1] / float(0xffffffffffffffff) * 255.;
+    }
+
+    return bounds;
+}
 
-                hist[a1 * 256 + a2]++;
+/// histo_3d_kernel counts the trigrams starting at every st-th of the first n_starts elements. The leading bins are
+/// partitioned among the threads, each of which scans every block but only counts the trigrams whose leading bin it
+/// owns, so the threads write to disjoint 256 KB slabs of hist without atomics or private copies of the histogram.
+/// st may be a std::integral_constant, see dispatch_stride().
+/// @param [in,out] hist The histogram. Unless touched is given, it is cleared first.
+/// @param [in,out] touched If not nullptr, hist is already all zero, and the flag of each leading bin counted is set.
+template<class Q, class S>
+static void histo_3d_kernel(int *hist, unsigned char *touched, const unsigned char *dat_u8, long n_starts, long es,
+                            S st, const calc_opts_t &opts, Q q) {
+    ThreadPool &pool = ThreadPool::instance();
+    int nt = n_starts / st < min_parallel_n ? 1 : pool.size();
+
+    std::vector<int> bounds = leading_bin_bounds(n_starts, st, nt, q);
+
+    // Each thread clears its own slabs
+    if (!touched) {
+        pool.parallel_for(nt, [&](long t) {
+            long s = long(bounds[t]) << 16;
+            long e = long(bounds[t + 1]) << 16;
+            memset(hist + s, 0, sizeof(hist[0]) * (e - s));
+        });
+    }
+
+    if (nt == 1) {
+        unsigned char seen[256] = {0};
+        for_each_window(dat_u8, n_starts, es, st, opts, [&](long first, long last) {
+            for (long i = first; i < last; i += st) {
+                int a1 = q(i + 0);
+                int a2 = q(i + 1);
+                int a3 = q(i + 2);
+
+                hist[a1 * 256 * 256 + a2 * 256 + a3]++;
+                seen[a1] = 1;
             }
+        });
+        if (touched) {
+            for (int b = 0; b < 256; b++) touched[b] |= seen[b];
         }
-            break;
-        case f32: {
-            auto dat_f32 = (const float *) dat_u8;
-            hist_float_helper_2d(hist, dat_f32, n);
-        }
-            break;
-        case f64: {
-            auto dat_f64 = (const double *) dat_u8;
-            hist_float_helper_2d(hist, dat_f64, n);
+        return;
+    }
+
+    const long block = max(long(st), histo_3d_block / es / st * st);
+
+    for_each_window(dat_u8, n_starts, es, st, opts, [&](long first, long last) {
+        // The threads scan the same block together, so it is read from memory once. Each block costs every thread
+        // a pass, so cancellation is also polled between blocks.
+        for (long bs = first; bs < last; bs += block) {
+            if (opts.cancel && *opts.cancel) break;
+
+            long be = min(last, bs + block);
+
+            pool.parallel_for(nt, [&](long t) {
+                unsigned int lo = bounds[t];
+                unsigned int span = bounds[t + 1] - lo;
+                if (span == 0) return;
+
+                unsigned char seen[256] = {0};
+                for (long i = bs; i < be; i += st) {
+                    unsigned int a1 = q(i + 0);
+                    if (a1 - lo >= span) continue;
+
+                    int a2 = q(i + 1);
+                    int a3 = q(i + 2);
+
+                    hist[a1 * 256 * 256 + a2 * 256 + a3]++;
+                    seen[a1] = 1;
+                }
+                // The flags of the thread's own leading bins, which no other thread writes
+                if (touched) {
+                    for (unsigned int b = lo; b < lo + span; b++) touched[b] |= seen[b];
+                }
+            });
         }
-            break;
+    });
+}
+
+/// generate_histo_3d_into computes a 3d histogram of each overlapping trigram within dat_u8 into a caller provided
+/// buffer, which may be reused between calls to avoid allocating and faulting in 64 MB each time.
+/// @param [out] hist The histogram, a linearized 256 * 256 * 256 array, which is cleared first.
+/// @param [in] dat_u8 Byte data to be analyzed.
+/// @param [in] n Length of dat_u8 in bytes.
+/// @param [in] dtype The type of data to cast dat_u8 as.
+/// @param [in] overlap Whether to move by a single byte (true) or length of dtype (false) (not implemented correctly.)
+/// @param [in] opts Controls streaming of dat_u8.
+void generate_histo_3d_into(int *hist, const unsigned char *dat_u8, long n, histo_dtype_t dtype, bool overlap,
+                            const calc_opts_t &opts) {
+    if (dtype == none) {
+        memset(hist, 0, sizeof(hist[0]) * 256 * 256 * 256);
+        return;
     }
 
+    dispatch_dtype(dat_u8, dtype, [&](auto q, long es) {
+        dispatch_stride(overlap, [&](auto st) {
+            histo_3d_kernel(hist, nullptr, dat_u8, n / es - 2, es, st, opts, q);
+        });
+    });
+
 #if 0
-    int n_vertices = 0;
+    n_vertices = 0;
     float m=10000000, M=-1, a=0.;
-    for(int i=0; i<256*256; i++) {
+    for(int i=0; i<256*256*256; i++) {
       if(hist[i] > 0) {
         n_vertices++;
 
@@ -200,210 +628,946 @@ int *generate_histo_2d(const unsigned char *dat_u8, long n, histo_dtype_t dtype)
     a /= n_vertices;
     printf("%d %f %f %f\n", n_vertices, m, M, a);
 #endif
+}
+
+/// generate_histo_3d computes a 3d histogram of each overlapping trigram within dat_u8.
+/// @param [in] dat_u8 Byte data to be analyzed.
+/// @param [in] n Length of dat_u8 in bytes.
+/// @param [in] dtype The type of data to cast dat_u8 as.
+/// @param [in] overlap Whether to move by a single byte (true) or length of dtype (false) (not implemented correctly.)
+/// @param [in] opts Controls streaming of dat_u8.
+/// @return The 3d histogram, as a linearized array of size 256 * 256 * 256, containing counts of each trigram,
+int *generate_histo_3d(const unsigned char *dat_u8, long n, histo_dtype_t dtype, bool overlap, const calc_opts_t &opts) {
+    auto hist = new int[256 * 256 * 256];
+    generate_histo_3d_into(hist, dat_u8, n, dtype, overlap, opts);
 
     return hist;
 }
 
-template<class T>
-void hist_float_helper_3d(int *hist, T *dat_f, long n, int st) {
-    for (long i = 0; i < n / long(sizeof(T)) - 2; i += st) {
-        int a1;
-        int a2;
-        int a3;
-        if (sizeof(T) == 4) {
-            a1 = ((dat_f[i + 0] / FLT_MAX) * 255. + 255.) / 2.;
-            a2 = ((dat_f[i + 1] / FLT_MAX) * 255. + 255.) / 2.;
-            a3 = ((dat_f[i + 2] / FLT_MAX) * 255. + 255.) / 2.;
-        } else if (sizeof(T) == 8) {
-            a1 = ((dat_f[i + 0] / DBL_MAX) * 255. + 255.) / 2.;
-            a2 = ((dat_f[i + 1] / DBL_MAX) * 255. + 255.) / 2.;
-            a3 = ((dat_f[i + 2] / DBL_MAX) * 255. + 255.) / 2.;
+// Below this many trigrams a sparse histogram is built by sorting, rather than by counting into a dense table
+static const long sparse_sort_max = 1L << 20;
+
+static void sorted_bins_to_sparse(std::vector<unsigned int> &bins, sparse_histo_t &hist);
+
+/// sparse_3d_sort builds a sparse histogram of the trigrams starting at every st-th of the first n_starts elements
+/// by radix sorting their bins and counting the runs, touching memory in proportion to the number of trigrams.
+template<class Q, class S>
+static void sparse_3d_sort(sparse_histo_t &hist, const unsigned char *dat_u8, long n_starts, long es, S st,
+                           const calc_opts_t &opts, Q q) {
+    std::vector<unsigned int> bins;
+    bins.reserve(max(0L, n_starts / st + 1));
+
+    for_each_window(dat_u8, n_starts, es, st, opts, [&](long first, long last) {
+        for (long i = first; i < last; i += st) {
+            unsigned int a1 = q(i + 0);
+            unsigned int a2 = q(i + 1);
+            unsigned int a3 = q(i + 2);
+
+            bins.push_back((a1 << 16) | (a2 << 8) | a3);
+        }
+    });
+
+    sorted_bins_to_sparse(bins, hist);
+}
+
+/// sorted_bins_to_sparse sorts the 24-bit bins and appends each run of equal bins to hist.
+static void sorted_bins_to_sparse(std::vector<unsigned int> &bins, sparse_histo_t &hist) {
+    // Least significant digit first, one pass per byte of the 24-bit bin
+    std::vector<unsigned int> tmp(bins.size());
+    for (int shift = 0; shift < 24; shift += 8) {
+        long cnt[257] = {0};
+        for (auto b : bins) cnt[((b >> shift) & 0xff) + 1]++;
+        for (int i = 0; i < 256; i++) cnt[i + 1] += cnt[i];
+        for (auto b : bins) tmp[cnt[(b >> shift) & 0xff]++] = b;
+        bins.swap(tmp);
+    }
+
+    for (auto b : bins) {
+        if (!hist.empty() && hist.back().bin == b) {
+            hist.back().count++;
         } else {
-            abort();
+            hist.push_back(sparse_bin_t{b, 1});
         }
+    }
+}
 
-        if (isnan(dat_f[i + 0])) a1 = 255;
-        if (isnan(dat_f[i + 1])) a2 = 255;
-        if (isnan(dat_f[i + 2])) a3 = 255;
+/// dense_3d_t is a dense 3d histogram lent by acquire_dense_3d(), all zero when lent, with a flag for each leading
+/// bin whose 256 KB slab may have been written since.
+struct dense_3d_t {
+    std::unique_ptr<int[]> hist;
+    unsigned char touched[256];
+};
 
-        if (isnan(dat_f[i + 0])) { if (signbit(dat_f[i + 0])) { a1 = 0; } else { a1 = 255; }}
-        if (isnan(dat_f[i + 1])) { if (signbit(dat_f[i + 1])) { a2 = 0; } else { a2 = 255; }}
-        if (isnan(dat_f[i + 2])) { if (signbit(dat_f[i + 2])) { a3 = 0; } else { a3 = 255; }}
+// At most one dense table exists, kept between counts so that they neither allocate nor fault in 64 MB each time. A
+// count superseded while still running stops at its next block and hands the table on, rather than both holding one.
+static std::mutex dense_3d_m;
+static std::condition_variable dense_3d_cv;
+static std::unique_ptr<dense_3d_t> dense_3d_idle;
+static bool dense_3d_lent = false;
 
-        if (isinf(dat_f[i + 0])) { if (signbit(dat_f[i + 0])) { a1 = 0; } else { a1 = 255; }}
-        if (isinf(dat_f[i + 1])) { if (signbit(dat_f[i + 1])) { a2 = 0; } else { a2 = 255; }}
-        if (isinf(dat_f[i + 2])) { if (signbit(dat_f[i + 2])) { a3 = 0; } else { a3 = 255; }}
+/// acquire_dense_3d lends the dense table, waiting for it to be released if it is lent already.
+static std::unique_ptr<dense_3d_t> acquire_dense_3d() {
+    std::unique_lock<std::mutex> lk(dense_3d_m);
+    dense_3d_cv.wait(lk, []() { return !dense_3d_lent; });
+    dense_3d_lent = true;
+    if (dense_3d_idle) return std::move(dense_3d_idle);
+    lk.unlock();
 
-/*
-    if(a1 < 0 || a1 > 255) {
-      printf("0 %d %f\n", a1, dat_f[i+0]);
-    }
-    if(a3 < 0 || a3 > 255) {
-      printf("2 %d %f\n", a3, dat_f[i+2]);
+    std::unique_ptr<dense_3d_t> d(new dense_3d_t);
+    d->hist.reset(new int[256 * 256 * 256]());
+    memset(d->touched, 0, sizeof(d->touched));
+    return d;
+}
+
+/// release_dense_3d clears the slabs of d still flagged as touched, and returns it for the next count.
+static void release_dense_3d(std::unique_ptr<dense_3d_t> d) {
+    for (int b = 0; b < 256; b++) {
+        if (d->touched[b]) memset(d->hist.get() + (long(b) << 16), 0, sizeof(int) << 16);
     }
-    if(a2 < 0 || a2 > 255) {
-      printf("1 %d %f %d %d\n", a2, dat_f[i+1], isnan(dat_f[i+1]), dat_f[i+1] < 0);
+    memset(d->touched, 0, sizeof(d->touched));
+
+    {
+        std::lock_guard<std::mutex> lk(dense_3d_m);
+        dense_3d_idle = std::move(d);
+        dense_3d_lent = false;
     }
-*/
+    dense_3d_cv.notify_one();
+}
 
-        if (a1 < 0) a1 = 0;
-        if (a2 < 0) a2 = 0;
-        if (a3 < 0) a3 = 0;
+/// compact_3d collects the occupied bins of a dense 3d histogram, the threads each compacting a range of slabs. Only
+/// the touched slabs are read, and each bin taken is cleared, along with the flag of its slab, leaving dense all zero.
+static void compact_3d(sparse_histo_t &hist, dense_3d_t &dense) {
+    ThreadPool &pool = ThreadPool::instance();
+    int nt = pool.size();
 
-        if (a1 > 255) a1 = 255;
-        if (a2 > 255) a2 = 255;
-        if (a3 > 255) a3 = 255;
+    std::vector<sparse_histo_t> parts(nt);
+    pool.parallel_for(nt, [&](long t) {
+        for (long b = 256L * t / nt; b < 256L * (t + 1) / nt; b++) {
+            if (!dense.touched[b]) continue;
 
-        hist[a1 * 256 * 256 + a2 * 256 + a3]++;
-    }
+            int *h = dense.hist.get();
+            for (long i = b << 16; i < (b + 1) << 16; i++) {
+                if (h[i] != 0) {
+                    parts[t].push_back(sparse_bin_t{(unsigned int) i, h[i]});
+                    h[i] = 0;
+                }
+            }
+            dense.touched[b] = 0;
+        }
+    });
+
+    size_t len = 0;
+    for (const auto &p : parts) len += p.size();
+    hist.reserve(len);
+    for (const auto &p : parts) hist.insert(hist.end(), p.begin(), p.end());
 }
 
-/// generate_histo_3d computes a 3d histogram of each overlapping digram within dat_u8.
+/// generate_histo_3d_sparse computes a sparse 3d histogram of each overlapping trigram within dat_u8. Small inputs
+/// are sorted directly; larger ones are counted into the shared dense table, see acquire_dense_3d(), and compacted,
+/// so that only the occupied bins are kept.
+/// @param [out] hist The occupied bins, in increasing order of bin.
 /// @param [in] dat_u8 Byte data to be analyzed.
 /// @param [in] n Length of dat_u8 in bytes.
 /// @param [in] dtype The type of data to cast dat_u8 as.
 /// @param [in] overlap Whether to move by a single byte (true) or length of dtype (false) (not implemented correctly.)
-/// @return The 2d histogram, as a linearized matrix of size 256 * 256, containing counts of each digram,
-int *generate_histo_3d(const unsigned char *dat_u8, long n, histo_dtype_t dtype, bool overlap) {
-    auto hist = new int[256 * 256 * 256];
-    memset(hist, 0, sizeof(hist[0]) * 256 * 256 * 256);
+/// @param [in] opts Controls streaming of dat_u8.
+void generate_histo_3d_sparse(sparse_histo_t &hist, const unsigned char *dat_u8, long n, histo_dtype_t dtype,
+                              bool overlap, const calc_opts_t &opts) {
+    hist.clear();
 
-    int st = overlap ? 1 : 3;
-
-    switch (dtype) {
-        case none:
-            break;
-        case u8: {
-            for (long i = 0; i < n - 2; i += st) {
-                int a1 = dat_u8[i + 0];
-                int a2 = dat_u8[i + 1];
-                int a3 = dat_u8[i + 2];
+    dispatch_dtype(dat_u8, dtype, [&](auto q, long es) {
+        long n_starts = n / es - 2;
+        if (n_starts <= 0) return;
 
-                hist[a1 * 256 * 256 + a2 * 256 + a3]++;
+        dispatch_stride(overlap, [&](auto st) {
+            if (n_starts / st < sparse_sort_max) {
+                sparse_3d_sort(hist, dat_u8, n_starts, es, st, opts, q);
+            } else {
+                std::unique_ptr<dense_3d_t> dense = acquire_dense_3d();
+                histo_3d_kernel(dense->hist.get(), dense->touched, dat_u8, n_starts, es, st, opts, q);
+                if (!opts.cancel || !*opts.cancel) compact_3d(hist, *dense);
+                release_dense_3d(std::move(dense));
             }
-        }
-            break;
-        case u12: {
-            auto dat_u16 = (const unsigned short *) dat_u8;
-            for (long i = 0; i < n / 2 - 2; i += st) {
-                int a1 = (dat_u16[i + 0] & 0x0fff) / float(0x0fff) * 255.;
-                int a2 = (dat_u16[i + 1] & 0x0fff) / float(0x0fff) * 255.;
-                int a3 = (dat_u16[i + 2] & 0x0fff) / float(0x0fff) * 255.;
+        });
+    });
+}
 
-                hist[a1 * 256 * 256 + a2 * 256 + a3]++;
-            }
+// Fewer samples than this are drawn by the calling thread alone
+static const long sample_parallel_n = 1L << 16;
+
+/// mix64 returns a well mixed hash of x (splitmix64), from which the sample positions are drawn, so that they are
+/// reproducible whatever the number of threads.
+static inline uint64_t mix64(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/// for_each_sample splits n_tuples tuples into n_samples equal strata and calls fn(t, j) with the index j of a tuple
+/// drawn uniformly from each, spread over the thread pool, t being the index of the calling thread's share.
+/// @param [in] nt Number of shares, see sample_threads().
+template<class F>
+static void for_each_sample(long n_tuples, long n_samples, int nt, F fn) {
+    ThreadPool::instance().parallel_for(nt, [&](long t) {
+        long ks = n_samples * t / nt;
+        long ke = n_samples * (t + 1) / nt;
+        for (long k = ks; k < ke; k++) {
+            long lo = long(double(k) * n_tuples / n_samples);
+            long hi = max(lo + 1, long(double(k + 1) * n_tuples / n_samples));
+            fn(t, min(n_tuples - 1, lo + long(mix64(k) % uint64_t(hi - lo))));
         }
-            break;
-        case u16: {
-            auto dat_u16 = (const unsigned short *) dat_u8;
-            for (long i = 0; i < n / 2 - 2; i += st) {
-                int a1 = dat_u16[i + 0] / float(0xffff) * 255.;
-                int a2 = dat_u16[i + 1] / float(0xffff) * 255.;
-                int a3 = dat_u16[i + 2] / float(0xffff) * 255.;
+    });
+}
 
-                hist[a1 * 256 * 256 + a2 * 256 + a3]++;
-            }
+static int sample_threads(long n_samples) {
+    return n_samples < sample_parallel_n ? 1 : ThreadPool::instance().size();
+}
+
+/// sampled_relative_error returns the relative standard error of a count estimated by scaling up the count within a
+/// uniform sample of a fraction of the tuples, so that a view can say how far to trust its bins.
+/// @param [in] frac Fraction of the tuples sampled, as returned by the sampling functions.
+/// @param [in] count The estimated count.
+/// @return The standard error as a fraction of count, or 0 if nothing was left out.
+float sampled_relative_error(double frac, double count) {
+    if (frac >= 1. || count <= 0.) return 0.f;
+
+    return float(sqrt((1. - frac) / (frac * count)));
+}
+
+// Weight of the latest measurement in the running estimates of a sample_budget_t
+static const double sample_budget_weight = .5;
+
+/// samples returns the number of tuples to count for a first look at n_tuples of them: n_tuples if they can all be
+/// counted within the budget, else as many as can be sampled within it.
+long sample_budget_t::samples(long n_tuples) const {
+    if (n_tuples * exact_ns <= budget_ns) return n_tuples;
+
+    return min(n_tuples, max(sample_parallel_n, long(budget_ns / sample_ns)));
+}
+
+/// record_exact updates the cost of an exact count from one of n_tuples that took ns nanoseconds.
+void sample_budget_t::record_exact(long n_tuples, double ns) {
+    if (n_tuples <= 0) return;
+    exact_ns += (ns / n_tuples - exact_ns) * sample_budget_weight;
+}
+
+/// record_sampled updates the cost of a sampled count from one of n_samples that took ns nanoseconds.
+void sample_budget_t::record_sampled(long n_samples, double ns) {
+    if (n_samples <= 0) return;
+    sample_ns += (ns / n_samples - sample_ns) * sample_budget_weight;
+}
+
+/// generate_histo_2d_sampled estimates the 2d histogram of the digrams within dat_u8 from about n_samples of them,
+/// drawn uniformly at random one from each of n_samples equal parts of the data, so that its cost is bounded by
+/// n_samples rather than n. The counts are scaled up to estimate those of generate_histo_2d().
+/// @param [in] dat_u8 Byte data to be analyzed.
+/// @param [in] n Length of dat_u8 in bytes.
+/// @param [in] dtype The type of data to cast dat_u8 as.
+/// @param [in] n_samples Number of digrams to count; if there are no more than this, all are counted exactly.
+/// @param [out] frac The fraction of the digrams counted, 1 if the histogram is exact.
+/// @return The estimated 2d histogram, as a linearized matrix of size 256 * 256.
+int *generate_histo_2d_sampled(const unsigned char *dat_u8, long n, histo_dtype_t dtype, long n_samples,
+                               double &frac) {
+    auto hist = new int[256 * 256];
+    memset(hist, 0, sizeof(hist[0]) * 256 * 256);
+    frac = 1.;
+
+    dispatch_dtype(dat_u8, dtype, [&](auto q, long es) {
+        long n_starts = n / es - 1;
+        if (n_starts <= 0) return;
+
+        if (n_samples >= n_starts) {
+            histo_2d_kernel(hist, dat_u8, n_starts, es, calc_opts_t(), q);
+            return;
         }
-            break;
-        case u32: {
-            auto dat_u32 = (const unsigned int *) dat_u8;
-            for (long i = 0; i < n / 4 - 2; i += st) {
-                int a1 = dat_u32[i + 0] / float(0xffffffff) * 255.;
-                int a2 = dat_u32[i + 1] / float(0xffffffff) * 255.;
-                int a3 = dat_u32[i + 2] / float(0xffffffff) * 255.;
 
-                hist[a1 * 256 * 256 + a2 * 256 + a3]++;
-            }
+        int nt = sample_threads(n_samples);
+        std::vector<std::vector<int> > parts(nt, std::vector<int>(256 * 256));
+        for_each_sample(n_starts, n_samples, nt, [&](long t, long i) {
+            parts[t][q(i) * 256 + q(i + 1)]++;
+        });
+
+        const double scale = double(n_starts) / n_samples;
+        for (int i = 0; i < 256 * 256; i++) {
+            long c = 0;
+            for (const auto &p : parts) c += p[i];
+            hist[i] = int(c * scale + .5);
         }
-            break;
-        case u64: {
-            auto dat_u64 = (const unsigned long *) dat_u8;
-            for (long i = 0; i < n / 8 - 2; i += st) {
-                int a1 = dat_u64[i + 0] / float(0xffffffffffffffff) * 255.;
-                int a2 = dat_u64[i + 1] / float(0xffffffffffffffff) * 255.;
-                int a3 = dat_u64[i + 2] / float(0xffffffffffffffff) * 255.;
+        frac = 1. / scale;
+    });
 
-                hist[a1 * 256 * 256 + a2 * 256 + a3]++;
+    return hist;
+}
+
+/// generate_histo_3d_sparse_sampled estimates the sparse 3d histogram of the trigrams within dat_u8 from about
+/// n_samples of them, as generate_histo_2d_sampled() does for digrams.
+/// @param [out] hist The occupied bins of the estimate, in increasing order of bin.
+/// @param [in] dat_u8 Byte data to be analyzed.
+/// @param [in] n Length of dat_u8 in bytes.
+/// @param [in] dtype The type of data to cast dat_u8 as.
+/// @param [in] overlap Whether to move by a single byte (true) or length of dtype (false) (not implemented correctly.)
+/// @param [in] n_samples Number of trigrams to count; if there are no more than this, all are counted exactly.
+/// @param [out] frac The fraction of the trigrams counted, 1 if the histogram is exact.
+void generate_histo_3d_sparse_sampled(sparse_histo_t &hist, const unsigned char *dat_u8, long n, histo_dtype_t dtype,
+                                      bool overlap, long n_samples, double &frac) {
+    hist.clear();
+    frac = 1.;
+
+    dispatch_dtype(dat_u8, dtype, [&](auto q, long es) {
+        long n_starts = n / es - 2;
+        if (n_starts <= 0) return;
+
+        dispatch_stride(overlap, [&](auto st) {
+            long n_tuples = (n_starts + st - 1) / st;
+            if (n_samples >= n_tuples) {
+                generate_histo_3d_sparse(hist, dat_u8, n, dtype, overlap);
+                return;
             }
+
+            int nt = sample_threads(n_samples);
+            std::vector<std::vector<unsigned int> > parts(nt);
+            for_each_sample(n_tuples, n_samples, nt, [&](long t, long j) {
+                long i = j * st;
+                unsigned int a1 = q(i + 0);
+                unsigned int a2 = q(i + 1);
+                unsigned int a3 = q(i + 2);
+
+                parts[t].push_back((a1 << 16) | (a2 << 8) | a3);
+            });
+
+            std::vector<unsigned int> bins;
+            bins.reserve(n_samples);
+            for (const auto &p : parts) bins.insert(bins.end(), p.begin(), p.end());
+            sorted_bins_to_sparse(bins, hist);
+
+            const double scale = double(n_tuples) / n_samples;
+            for (auto &b : hist) b.count = int(b.count * scale + .5);
+            frac = 1. / scale;
+        });
+    });
+}
+
+/// range_delta_t describes the tuples that leave and enter a range as it moves, as element ranges counted from base.
+struct range_delta_t {
+    const unsigned char *base;
+    long sub[2][2];
+    long add[2][2];
+};
+
+/// plan_range_delta finds the tuples of len elements, starting at every st-th element, that left [old_dat, old_n) and
+/// entered [dat, n).
+/// @return Whether the ranges share a tuple grid and the update reads little enough of the new range to beat
+/// recomputing it with every thread.
+static bool plan_range_delta(range_delta_t &d, const unsigned char *old_dat, long old_n, const unsigned char *dat,
+                             long n, long es, int st, int len) {
+    if (old_dat == nullptr || dat == nullptr) return false;
+
+    const unsigned char *base = min(old_dat, dat);
+    long oo = old_dat - base;
+    long no = dat - base;
+    if (oo % (es * st) != 0 || no % (es * st) != 0) return false;
+
+    // The number of starts is rounded up to the grid, so that the ends of every range below stay on it
+    auto starts = [&](long nb) {
+        long s = nb / es - (len - 1);
+        return s <= 0 ? 0 : (s + st - 1) / st * st;
+    };
+    long o0 = oo / es, o1 = o0 + starts(old_n);
+    long n0 = no / es, n1 = n0 + starts(n);
+
+    d.base = base;
+    d.sub[0][0] = o0;
+    d.sub[0][1] = min(o1, n0);
+    d.sub[1][0] = max(o0, n1);
+    d.sub[1][1] = o1;
+    d.add[0][0] = n0;
+    d.add[0][1] = min(n1, o0);
+    d.add[1][0] = max(n0, o1);
+    d.add[1][1] = n1;
+
+    long work = 0;
+    for (int k = 0; k < 2; k++) {
+        work += max(0L, d.sub[k][1] - d.sub[k][0]) + max(0L, d.add[k][1] - d.add[k][0]);
+    }
+
+    return work * 2 * ThreadPool::instance().size() <= n1 - n0;
+}
+
+/// for_each_delta calls fn(i, -1) for each tuple start i that left the range and fn(i, 1) for each that entered it.
+template<class F>
+static void for_each_delta(const range_delta_t &d, long es, int st, const calc_opts_t &opts, F fn) {
+    for (int k = 0; k < 4; k++) {
+        const long *r = k < 2 ? d.sub[k] : d.add[k - 2];
+        int sign = k < 2 ? -1 : 1;
+        long a = r[0];
+        if (r[1] <= a) continue;
+
+        for_each_window(d.base + a * es, r[1] - a, es, st, opts, [&](long first, long last) {
+            for (long i = a + first; i < a + last; i += st) fn(i, sign);
+        });
+    }
+}
+
+/// update_histo_2d turns hist, the 2d histogram of old_dat, into that of dat_u8 by counting only the digrams that
+/// left and entered the range, as when a selection is dragged.
+/// @param [in,out] hist The histogram of old_dat, as returned by generate_histo_2d().
+/// @param [in] old_dat The data hist was computed for, or nullptr if none.
+/// @param [in] old_n Length of old_dat in bytes.
+/// @param [in] dat_u8 Byte data to be analyzed, within the same buffer as old_dat.
+/// @param [in] n Length of dat_u8 in bytes.
+/// @param [in] dtype The type of data to cast dat_u8 as, which hist was also computed with.
+/// @param [in] opts Controls streaming of dat_u8.
+/// @return Whether hist was updated. If not, the ranges share too little for an update to pay, and hist is unchanged.
+bool update_histo_2d(int *hist, const unsigned char *old_dat, long old_n, const unsigned char *dat_u8, long n,
+                     histo_dtype_t dtype, const calc_opts_t &opts) {
+    bool rv = false;
+
+    dispatch_dtype(dat_u8, dtype, [&](auto q0, long es) {
+        range_delta_t d;
+        if (!plan_range_delta(d, old_dat, old_n, dat_u8, n, es, 1, 2)) return;
+        rv = true;
+
+        auto q = decltype(q0){(decltype(q0.d)) d.base};
+        for_each_delta(d, es, 1, opts, [&](long i, int sign) {
+            hist[q(i + 0) * 256 + q(i + 1)] += sign;
+        });
+    });
+
+    return rv;
+}
+
+/// merge_sparse adds add to, and subtracts sub from, hist, dropping the bins left empty.
+static void merge_sparse(sparse_histo_t &hist, const sparse_histo_t &add, const sparse_histo_t &sub) {
+    sparse_histo_t out;
+    out.reserve(hist.size() + add.size());
+
+    const unsigned int end = 1u << 24;
+    size_t i = 0, j = 0, k = 0;
+    for (;;) {
+        unsigned int b = min(i < hist.size() ? hist[i].bin : end, min(j < add.size() ? add[j].bin : end,
+                                                                      k < sub.size() ? sub[k].bin : end));
+        if (b == end) break;
+
+        int c = 0;
+        if (i < hist.size() && hist[i].bin == b) c += hist[i++].count;
+        if (j < add.size() && add[j].bin == b) c += add[j++].count;
+        if (k < sub.size() && sub[k].bin == b) c -= sub[k++].count;
+        if (c != 0) out.push_back(sparse_bin_t{b, c});
+    }
+
+    hist.swap(out);
+}
+
+/// update_histo_3d_sparse turns hist, the sparse 3d histogram of old_dat, into that of dat_u8 by counting only the
+/// trigrams that left and entered the range, as when a selection is dragged.
+/// @param [in,out] hist The histogram of old_dat, as computed by generate_histo_3d_sparse().
+/// @param [in] old_dat The data hist was computed for, or nullptr if none.
+/// @param [in] old_n Length of old_dat in bytes.
+/// @param [in] dat_u8 Byte data to be analyzed, within the same buffer as old_dat.
+/// @param [in] n Length of dat_u8 in bytes.
+/// @param [in] dtype The type of data to cast dat_u8 as, which hist was also computed with.
+/// @param [in] overlap As hist was computed with.
+/// @param [in] opts Controls streaming of dat_u8.
+/// @return Whether hist was updated. If not, the ranges share too little for an update to pay, and hist is unchanged.
+bool update_histo_3d_sparse(sparse_histo_t &hist, const unsigned char *old_dat, long old_n,
+                            const unsigned char *dat_u8, long n, histo_dtype_t dtype, bool overlap,
+                            const calc_opts_t &opts) {
+    bool rv = false;
+
+    int st = overlap ? 1 : 3;
+
+    dispatch_dtype(dat_u8, dtype, [&](auto q0, long es) {
+        range_delta_t d;
+        if (!plan_range_delta(d, old_dat, old_n, dat_u8, n, es, st, 3)) return;
+        rv = true;
+
+        auto q = decltype(q0){(decltype(q0.d)) d.base};
+        std::vector<unsigned int> add_bins, sub_bins;
+        for_each_delta(d, es, st, opts, [&](long i, int sign) {
+            unsigned int a1 = q(i + 0);
+            unsigned int a2 = q(i + 1);
+            unsigned int a3 = q(i + 2);
+
+            (sign > 0 ? add_bins : sub_bins).push_back((a1 << 16) | (a2 << 8) | a3);
+        });
+        if (add_bins.empty() && sub_bins.empty()) return;
+
+        sparse_histo_t add, sub;
+        sorted_bins_to_sparse(add_bins, add);
+        sorted_bins_to_sparse(sub_bins, sub);
+        merge_sparse(hist, add, sub);
+    });
+
+    return rv;
+}
+
+/// sort_sparse_by_count reorders hist by decreasing count, keeping bins of equal count in increasing order of bin, so
+/// that the bins at or above any threshold are a prefix of it. It is a radix sort with a pass per byte of the largest
+/// count, rarely more than two.
+/// @param [in,out] hist A sparse histogram, as from generate_histo_3d_sparse(), which is no longer in order of bin.
+void sort_sparse_by_count(sparse_histo_t &hist) {
+    unsigned int max_count = 0;
+    for (const auto &b : hist) max_count = max(max_count, (unsigned int) b.count);
+
+    // Sorting on max_count - count orders by decreasing count
+    sparse_histo_t tmp(hist.size());
+    for (int shift = 0; shift < 32 && (max_count >> shift) != 0; shift += 8) {
+        long cnt[257] = {0};
+        for (const auto &b : hist) cnt[(((max_count - b.count) >> shift) & 0xff) + 1]++;
+        for (int i = 0; i < 256; i++) cnt[i + 1] += cnt[i];
+        for (const auto &b : hist) tmp[cnt[((max_count - b.count) >> shift) & 0xff]++] = b;
+        hist.swap(tmp);
+    }
+}
+
+/// coarsen_sparse merges the bins of hist into voxels 2^shift bins on a side, each taking the largest count of the bins
+/// within it, so that a voxel is at or above a threshold exactly when one of its bins is. A voxel is placed at the bin
+/// at its centre, so coarsening a coarsened histogram further gives the same voxels as coarsening the original.
+/// @param [out] out The occupied voxels, in increasing order of bin.
+/// @param [in] hist A sparse 3d histogram, as from generate_histo_3d_sparse(), in any order.
+/// @param [in] shift The log2 of the side of a voxel in bins, from 1 to 7.
+void coarsen_sparse(sparse_histo_t &out, const sparse_histo_t &hist, int shift) {
+    out.clear();
+
+    int side = 256 >> shift;
+    unsigned int half = 1u << (shift - 1);
+    std::vector<int> dense(long(side) * side * side, 0);
+    for (const auto &b : hist) {
+        long x = b.bin >> (16 + shift);
+        long y = ((b.bin >> 8) & 0xff) >> shift;
+        long z = (b.bin & 0xff) >> shift;
+        int &c = dense[(x * side + y) * side + z];
+        c = max(c, b.count);
+    }
+
+    for (long i = 0; i < long(dense.size()); i++) {
+        if (dense[i] == 0) continue;
+        unsigned int x = ((unsigned int) (i / side / side) << shift) | half;
+        unsigned int y = ((unsigned int) (i / side % side) << shift) | half;
+        unsigned int z = ((unsigned int) (i % side) << shift) | half;
+        out.push_back(sparse_bin_t{(x << 16) | (y << 8) | z, dense[i]});
+    }
+}
+
+/// entropy_blocks_per_out returns the number of consecutive blocks averaged into each entry of the entropy vector.
+static long entropy_blocks_per_out(long n, int bs, const calc_opts_t &opts) {
+    long nb = n / bs + (n % bs ? 1 : 0);
+    // Blocks per output entry, so that a stream of any length yields a bounded result
+    long bpo = 1;
+    if (opts.max_out > 0 && nb > opts.max_out) {
+        bpo = nb / opts.max_out + (nb % opts.max_out ? 1 : 0);
+    }
+    return bpo;
+}
+
+/// clogc_table returns c log(c) for each count c from 0 to bs, the terms of the entropy of a block of bs bytes.
+static std::vector<double> clogc_table(int bs) {
+    std::vector<double> t(bs + 1, 0.);
+    for (int c = 1; c <= bs; c++) {
+        t[c] = c * log(double(c));
+    }
+    return t;
+}
+
+/// count_block counts the len bytes of dat into c, whose two tables are summed to give the count of each value. The
+/// bytes are counted as in count_bytes(), but with only two tables, as clearing more would cost more than it saves
+/// on a block.
+static void count_block(const unsigned char *dat, long len, uint32_t c[2][256]) {
+    static const uint64_t ones = 0x0101010101010101ULL;
+
+    memset(c, 0, sizeof(c[0]) * 2);
+
+    long i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, dat + i, sizeof(w));
+        if (w == (w & 0xff) * ones) {
+            c[0][w & 0xff] += 8;
+            continue;
         }
-            break;
-        case f32: {
-            auto dat_f32 = (const float *) dat_u8;
-            hist_float_helper_3d(hist, dat_f32, n, st);
-        }
-            break;
-        case f64: {
-            auto dat_f64 = (const double *) dat_u8;
-            hist_float_helper_3d(hist, dat_f64, n, st);
+        for (int k = 0; k < 64; k += 16) {
+            c[0][(w >> k) & 0xff]++;
+            c[1][(w >> (k + 8)) & 0xff]++;
         }
-            break;
     }
+    for (; i < len; i++) {
+        c[0][dat[i]]++;
+    }
+}
 
-#if 0
-    n_vertices = 0;
-    float m=10000000, M=-1, a=0.;
-    for(int i=0; i<256*256*256; i++) {
-      if(hist[i] > 0) {
-        n_vertices++;
+/// block_entropy returns the entropy of the len bytes of dat, scaled between [0., 1.], using H = (len log(len) -
+/// sum(c log(c))) / len over the byte counts c, so that the logarithms are looked up in clogc rather than computed.
+/// @param [out] c If not null, receives the byte counts, as from count_block().
+static float block_entropy(const unsigned char *dat, long len, const double *clogc, uint32_t (*c)[256] = nullptr) {
+    uint32_t tmp[2][256];
+    if (c == nullptr) c = tmp;
+    count_block(dat, len, c);
 
-        if(m > hist[i]) m = hist[i];
-        if(M < hist[i]) M = hist[i];
-        a += hist[i];
-      }
+    // Independent sums, so that the additions are not serialized
+    double s[4] = {0., 0., 0., 0.};
+    for (int j = 0; j < 256; j += 4) {
+        s[0] += clogc[c[0][j + 0] + c[1][j + 0]];
+        s[1] += clogc[c[0][j + 1] + c[1][j + 1]];
+        s[2] += clogc[c[0][j + 2] + c[1][j + 2]];
+        s[3] += clogc[c[0][j + 3] + c[1][j + 3]];
     }
-    a /= n_vertices;
-    printf("%d %f %f %f\n", n_vertices, m, M, a);
-#endif
 
-    return hist;
+    double h = (clogc[len] - (s[0] + s[1] + s[2] + s[3])) / len;
+    return float(h / log(2.) / 8.);
 }
 
-/// generate_entropy computes the entropy within bs-sized blocks of dat_u8.
+/// entropy_len returns the length of the entropy vector computed for n bytes.
+/// @param [in] n Length of the data in bytes.
+/// @param [in] bs The block sized used to analyze the data.
+/// @param [in] opts The options the entropy will be computed with.
+/// @return The number of entries in the entropy vector.
+long entropy_len(long n, int bs, const calc_opts_t &opts) {
+    if (n <= 0) return 0;
+
+    long nb = n / bs + (n % bs ? 1 : 0);
+    long bpo = entropy_blocks_per_out(n, bs, opts);
+    return nb / bpo + (nb % bpo ? 1 : 0);
+}
+
+/// generate_entropy_into computes the entropy within bs-sized blocks of dat_u8 into a caller provided vector.
+/// Each entry is complete once opts.progress has reported the bytes it covers, so a partial vector may be shown.
+/// @param [out] dd The vector receiving the entropy, of length entropy_len(n, bs, opts).
 /// @param [in] dat_u8 Byte data to be analyzed.
 /// @param [in] n Length of dat_u8 in bytes.
-/// @param [out] rv_len The length of the return vector.
 /// @param [in] bs The block sized used to analyze dat_u8.
-/// @return The calculated entropy for each block of dat_u8, as vector of length rv_len scaled between [0., 1.]
-float *generate_entropy(const unsigned char *dat_u8, long n, long &rv_len, int bs) { //, histo_dtype_t dtype) {
-    if (n <= 0) {
-        rv_len = 0;
-        return nullptr;
-    }
+/// @param [in] opts Controls streaming of dat_u8. With opts.max_out set, runs of consecutive blocks are averaged
+///                  so that the vector has at most that many entries.
+void generate_entropy_into(float *dd, const unsigned char *dat_u8, long n, int bs, const calc_opts_t &opts) {
+    if (n <= 0) return;
 
     int inc = bs; // set to a value less than bs to create overlapping
 
-    long ddn = n / inc + (n % inc ? 1 : 0);
-    auto dd = new float[ddn];
+    long bpo = entropy_blocks_per_out(n, bs, opts);
+    long ddn = entropy_len(n, bs, opts);
     memset(dd, 0, sizeof(dd[0]) * ddn);
 
-    for (long is = 0; is < n; is += inc) {
-        long ie = min(n, is + bs);
+    std::vector<double> clogc = clogc_table(bs);
+    ThreadPool &pool = ThreadPool::instance();
 
-        int dict[256] = {0};
-        for (long i = is; i < ie; i++) {
-            dict[dat_u8[i]]++;
-        }
+    // Windows are aligned to whole entries, which are shared among the threads so that each entry has one writer
+    long epw = long(inc) * bpo;
+    for_each_window(dat_u8, n, 1, epw, opts, [&](long first, long last) {
+        long n_entries = (last - first + epw - 1) / epw;
+        long nt = last - first < min_parallel_n ? 1 : min(n_entries, long(pool.size()) * 4);
 
-        float entropy = 0.;
-        for (int i = 0; i < 256; i++) {
-            float p = dict[i] / float(ie - is);
-            if (p > 0.) {
-                entropy += -p * logf(p);
+        pool.parallel_for(nt, [&](long t) {
+            long s = first + n_entries * t / nt * epw;
+            long e = min(last, first + n_entries * (t + 1) / nt * epw);
+
+            for (long is = s; is < e; is += inc) {
+                long ie = min(n, is + bs);
+
+                float entropy = block_entropy(dat_u8 + is, ie - is, clogc.data());
+
+                long di = is / bs / bpo;
+                if (di >= ddn) {
+                    //printf("%d %d %d %d\n", is, bs, is/bs, n);
+                    continue;
+                }
+
+                long bi = is / bs % bpo;
+                dd[di] += (entropy - dd[di]) / (bi + 1);
             }
-        }
-        entropy /= logf(2.0);
-        entropy /= 8.0;
+        });
+    });
+}
 
-        int di = is / bs;
-        if (di >= ddn) {
-            //printf("%d %d %d %d\n", is, bs, is/bs, n);
-            continue;
+/// entropy_sliding_len returns the length of the sliding entropy vector computed for n bytes.
+/// @param [in] n Length of the data in bytes.
+/// @param [in] step Window starts per entry.
+/// @param [in] bs The window size used to analyze the data.
+/// @return The number of entries in the entropy vector.
+long entropy_sliding_len(long n, long step, int bs) {
+    if (n <= 0) return 0;
+
+    step = max(1L, step);
+    long n_starts = n - min(long(bs), n) + 1;
+    return (n_starts + step - 1) / step;
+}
+
+/// generate_entropy_sliding_into computes the entropy of the bs-byte window starting at every byte of dat_u8, into
+/// a caller provided vector holding the mean of each run of step windows. The counts and sum(c log(c)) of the window
+/// are updated as a byte enters and one leaves, so each byte costs the same whatever bs is. The sums are kept in
+/// fixed point, so that they are exact however far the window slides.
+/// @param [out] dd The vector receiving the entropy, of length entropy_sliding_len(n, step, bs).
+/// @param [in] dat_u8 Byte data to be analyzed.
+/// @param [in] n Length of dat_u8 in bytes.
+/// @param [in] step Window starts per entry.
+/// @param [in] bs The window size used to analyze dat_u8. If n is smaller, the single window is all of dat_u8.
+/// @param [in] opts Controls streaming of dat_u8.
+void generate_entropy_sliding_into(float *dd, const unsigned char *dat_u8, long n, long step, int bs,
+                                   const calc_opts_t &opts) {
+    if (n <= 0) return;
+
+    step = max(1L, step);
+    long w = min(long(bs), n);
+    long n_starts = n - w + 1;
+
+    static const double scale = 4294967296.;
+    std::vector<int64_t> clogc(w + 1, 0);
+    for (long c = 1; c <= w; c++) {
+        clogc[c] = llround(c * log(double(c)) * scale);
+    }
+    // The change in sum(c log(c)) as a count goes from c to c + 1
+    std::vector<int64_t> up(w + 1, 0);
+    for (long c = 0; c < w; c++) {
+        up[c] = clogc[c + 1] - clogc[c];
+    }
+    // Sums of up to this many window sums fit in 63 bits
+    const long flush = max(1L, long((1LL << 62) / max(int64_t(1), clogc[w])));
+    const double norm = 1. / (w * scale * log(2.) * 8.);
+
+    ThreadPool &pool = ThreadPool::instance();
+
+    // Windows are aligned to whole entries, which are shared among the threads so that each entry has one writer
+    for_each_window(dat_u8, n_starts, 1, step, opts, [&](long first, long last) {
+        long n_entries = (last - first + step - 1) / step;
+        long nt = last - first < min_parallel_n ? 1 : min(n_entries, long(pool.size()) * 4);
+
+        pool.parallel_for(nt, [&](long t) {
+            long s = first + n_entries * t / nt * step;
+            long e = min(last, first + n_entries * (t + 1) / nt * step);
+            if (s >= e) return;
+
+            uint32_t c[256] = {0};
+            for (long i = s; i < s + w; i++) {
+                c[dat_u8[i]]++;
+            }
+            int64_t sum = 0;
+            for (int j = 0; j < 256; j++) {
+                sum += clogc[c[j]];
+            }
+
+            for (long k = s; k < e; k += step) {
+                long ke = min(e, k + step);
+
+                double acc = 0.;
+                int64_t part = 0;
+                long n_part = 0;
+                // The first window was counted above
+                long i = k;
+                if (i == s) {
+                    part += sum;
+                    n_part++;
+                    i++;
+                }
+                while (i < ke) {
+                    // Where the eight bytes leaving equal the eight entering, as in runs, the counts are unchanged
+                    uint64_t wl, we;
+                    if (i + 8 <= ke && flush > 16) {
+                        memcpy(&wl, dat_u8 + i - 1, sizeof(wl));
+                        memcpy(&we, dat_u8 + i + w - 1, sizeof(we));
+                        if (wl == we) {
+                            part += 8 * sum;
+                            n_part += 8;
+                            i += 8;
+                            if (n_part >= flush - 8) {
+                                acc += double(part);
+                                part = 0;
+                                n_part = 0;
+                            }
+                            continue;
+                        }
+                    }
+
+                    unsigned char bl = dat_u8[i - 1];
+                    unsigned char be = dat_u8[i + w - 1];
+                    c[bl]--;
+                    sum += up[c[be]] - up[c[bl]];
+                    c[be]++;
+                    part += sum;
+                    n_part++;
+                    i++;
+                    if (n_part >= flush - 8) {
+                        acc += double(part);
+                        part = 0;
+                        n_part = 0;
+                    }
+                }
+                acc += double(part);
+
+                long cnt = ke - k;
+                dd[k / step] = float((double(clogc[w]) * cnt - acc) * norm / cnt);
+            }
+        });
+    });
+}
+
+/// generate_entropy_sliding computes the entropy of the bs-byte window starting at every byte of dat_u8, see
+/// generate_entropy_sliding_into().
+/// @param [in] dat_u8 Byte data to be analyzed.
+/// @param [in] n Length of dat_u8 in bytes.
+/// @param [in] step Window starts per entry.
+/// @param [out] rv_len The length of the return vector.
+/// @param [in] bs The window size used to analyze dat_u8.
+/// @param [in] opts Controls streaming of dat_u8.
+/// @return The mean entropy of each run of step windows, as vector of length rv_len scaled between [0., 1.]
+float *generate_entropy_sliding(const unsigned char *dat_u8, long n, long step, long &rv_len, int bs,
+                                const calc_opts_t &opts) {
+    rv_len = entropy_sliding_len(n, step, bs);
+    if (rv_len == 0) return nullptr;
+
+    auto dd = new float[rv_len];
+    generate_entropy_sliding_into(dd, dat_u8, n, step, bs, opts);
+
+    return dd;
+}
+
+// Bounds on the entries of the finest and coarsest levels of an entropy_pyramid_t. The finest is still finer than the
+// screen for the smallest selection allowed, 1% of the file.
+static const long pyramid_max_base = 1L << 20;
+static const long pyramid_min_top = 256;
+
+/// bytes returns the memory held by the pyramid.
+long entropy_pyramid_t::bytes() const {
+    long rv = 0;
+    for (const auto &l : levels) rv += long(l.size() * sizeof(l[0]));
+    return rv;
+}
+
+/// build_entropy_pyramid computes the entropy and the mean, minimum and maximum byte of the blocks of dat_u8, reading
+/// it once, and combines them into successively coarser levels.
+/// @param [out] p The pyramid. levels[0] is sized before dat_u8 is read, and its entries are complete once
+///                opts.progress has reported the bytes they cover.
+/// @param [in] dat_u8 Byte data to be analyzed.
+/// @param [in] n Length of dat_u8 in bytes.
+/// @param [in] bs The block sized used to compute the entropy.
+/// @param [in] opts Controls streaming of dat_u8. If cancelled, p is left invalid.
+void build_entropy_pyramid(entropy_pyramid_t &p, const unsigned char *dat_u8, long n, int bs, const calc_opts_t &opts) {
+    p = entropy_pyramid_t();
+    if (n <= 0) return;
+
+    calc_opts_t base_opts;
+    base_opts.max_out = pyramid_max_base;
+    long bpo = entropy_blocks_per_out(n, bs, base_opts);
+
+    p.bs = bs;
+    p.block = long(bs) * bpo;
+    p.n = n;
+    p.levels.resize(1);
+    p.levels[0].resize((n + p.block - 1) / p.block);
+
+    std::vector<double> clogc = clogc_table(bs);
+    ThreadPool &pool = ThreadPool::instance();
+
+    for_each_window(dat_u8, n, 1, p.block, opts, [&](long first, long last) {
+        long n_entries = (last - first + p.block - 1) / p.block;
+        long nt = last - first < min_parallel_n ? 1 : min(n_entries, long(pool.size()) * 4);
+
+        pool.parallel_for(nt, [&](long t) {
+            long s = first + n_entries * t / nt * p.block;
+            long e = min(last, first + n_entries * (t + 1) / nt * p.block);
+
+            for (long es = s; es < e; es += p.block) {
+                long ee = min(n, es + p.block);
+
+                float entropy = 0.;
+                uint64_t sum = 0;
+                int mn = 255, mx = 0;
+                for (long is = es, bi = 0; is < ee; is += bs, bi++) {
+                    uint32_t c[2][256];
+                    entropy += (block_entropy(dat_u8 + is, min(ee, is + bs) - is, clogc.data(), c) - entropy) / (bi + 1);
+                    uint32_t bsum = 0;
+                    for (int j = 0; j < 256; j++) {
+                        bsum += (c[0][j] + c[1][j]) * j;
+                    }
+                    sum += bsum;
+
+                    int lo = 0, hi = 255;
+                    while (c[0][lo] + c[1][lo] == 0) lo++;
+                    while (c[0][hi] + c[1][hi] == 0) hi--;
+                    mn = min(mn, lo);
+                    mx = max(mx, hi);
+                }
+
+                block_stats_t &b = p.levels[0][es / p.block];
+                b.entropy = entropy;
+                b.mean = (unsigned short) ((sum * 256 + (ee - es) / 2) / (ee - es));
+                b.min = (unsigned char) mn;
+                b.max = (unsigned char) mx;
+            }
+        });
+    });
+    if (opts.cancel && *opts.cancel) {
+        p = entropy_pyramid_t();
+        return;
+    }
+
+    // Each coarser entry combines four finer ones, weighted by the bytes they cover
+    for (long blk = p.block; long(p.levels.back().size()) > pyramid_min_top; blk *= 4) {
+        const std::vector<block_stats_t> &fine = p.levels.back();
+        std::vector<block_stats_t> coarse((fine.size() + 3) / 4);
+
+        for (size_t i = 0; i < coarse.size(); i++) {
+            double entropy = 0., mean = 0.;
+            long w = 0;
+            int mn = 255, mx = 0;
+            for (size_t j = i * 4; j < min(fine.size(), i * 4 + 4); j++) {
+                long wj = min(n, long(j + 1) * blk) - long(j) * blk;
+                entropy += double(fine[j].entropy) * wj;
+                mean += double(fine[j].mean) * wj;
+                w += wj;
+                mn = min(mn, int(fine[j].min));
+                mx = max(mx, int(fine[j].max));
+            }
+            coarse[i].entropy = float(entropy / w);
+            coarse[i].mean = (unsigned short) (mean / w + .5);
+            coarse[i].min = (unsigned char) mn;
+            coarse[i].max = (unsigned char) mx;
         }
 
-        dd[di] = entropy;
+        p.levels.push_back(std::move(coarse));
+    }
+}
+
+/// read_entropy_pyramid returns the entries of p overlapping [start, end), at the coarsest level that still has at
+/// least min_len of them, or the finest level if none has.
+/// @param [in] p The pyramid.
+/// @param [in] start Start of the range.
+/// @param [in] end End of the range.
+/// @param [in] min_len The resolution wanted, e.g. the height of the plot.
+/// @param [out] out The entries, in order.
+void read_entropy_pyramid(const entropy_pyramid_t &p, long start, long end, long min_len,
+                          std::vector<block_stats_t> &out) {
+    out.clear();
+    if (!p.isValid() || end <= start) return;
+
+    int level = 0;
+    long blk = p.block;
+    while (level + 1 < int(p.levels.size()) && (end - start) / (blk * 4) >= min_len) {
+        level++;
+        blk *= 4;
+    }
+
+    const std::vector<block_stats_t> &l = p.levels[level];
+    long s = min(long(l.size()), start / blk);
+    long e = min(long(l.size()), (end + blk - 1) / blk);
+    out.assign(l.begin() + s, l.begin() + e);
+}
+
+/// generate_entropy computes the entropy within bs-sized blocks of dat_u8.
+/// @param [in] dat_u8 Byte data to be analyzed.
+/// @param [in] n Length of dat_u8 in bytes.
+/// @param [out] rv_len The length of the return vector.
+/// @param [in] bs The block sized used to analyze dat_u8.
+/// @param [in] opts Controls streaming of dat_u8. With opts.max_out set, runs of consecutive blocks are averaged
+///                  so that the return vector has at most that many entries.
+/// @return The calculated entropy for each block of dat_u8, as vector of length rv_len scaled between [0., 1.]
+float *generate_entropy(const unsigned char *dat_u8, long n, long &rv_len, int bs, const calc_opts_t &opts) { //, histo_dtype_t dtype) {
+    if (n <= 0) {
+        rv_len = 0;
+        return nullptr;
     }
 
-    rv_len = ddn;
+    rv_len = entropy_len(n, bs, opts);
+    auto dd = new float[rv_len];
+    generate_entropy_into(dd, dat_u8, n, bs, opts);
 
     return dd;
 }
@@ -20,20 +20,167 @@
 #ifndef _HISTOGRAM_CALC_H_
 #define _HISTOGRAM_CALC_H_
 
+#include <atomic>
+#include <cstdint>
+#include <functional>
 #include <string>
+#include <vector>
 
+// The types without a suffix are little-endian
 typedef enum {
-    none, u8, u12, u16, u32, u64, f32, f64
+    none, u8, u12, u16, u32, u64, f32, f64, u16be, u32be, u64be, f32be, f64be
 } histo_dtype_t;
 
+/// calc_opts_t controls how the kernels walk their input, allowing inputs larger than memory to be streamed.
+struct calc_opts_t {
+    /// Bytes processed per window, or 0 to process the input as a single window.
+    long window;
+    /// Upper bound on the length of per-block outputs such as entropy, or 0 for no bound.
+    long max_out;
+    /// Called with each window once a kernel is finished with it, e.g. to drop mapped pages.
+    std::function<void(const unsigned char *, long)> release;
+    /// Called after each window with the number of bytes processed so far.
+    std::function<void(long)> progress;
+    /// If set, polled between windows; the kernel stops early, leaving a partial result, once it becomes true.
+    const std::atomic<bool> *cancel;
+
+    calc_opts_t() : window(0), max_out(0), cancel(nullptr) {}
+};
+
+/// sparse_bin_t is an occupied bin of a sparse histogram.
+struct sparse_bin_t {
+    unsigned int bin;
+    int count;
+};
+
+/// sparse_histo_t is a histogram holding only its occupied bins, in increasing order of bin.
+typedef std::vector<sparse_bin_t> sparse_histo_t;
+
+/// byte_index_t holds cumulative byte counts at regular block boundaries, so that the byte histogram of any range
+/// can be found without reading more than the parts of its edge blocks.
+struct byte_index_t {
+    /// Bytes per block, a power of two.
+    long block;
+    /// Length of the indexed data in bytes.
+    long n;
+    /// 256 counts per block boundary; the counts at boundary b are of the bytes before min(b * block, n).
+    std::vector<uint64_t> counts;
+
+    byte_index_t() : block(0), n(0) {}
+
+    bool isValid() const { return !counts.empty(); }
+
+    long bytes() const { return long(counts.size() * sizeof(counts[0])); }
+};
+
+/// block_stats_t summarizes the bytes of a block.
+struct block_stats_t {
+    /// Mean entropy of the bs-byte blocks within, scaled between [0., 1.]
+    float entropy;
+    /// Mean byte, times 256.
+    unsigned short mean;
+    unsigned char min;
+    unsigned char max;
+};
+
+/// entropy_pyramid_t holds block_stats_t of data at several resolutions, so that a range of any length can be
+/// summarized at screen resolution without reading it. The blocks of each level are four times those of the previous.
+struct entropy_pyramid_t {
+    /// Block size used to compute the entropy.
+    int bs;
+    /// Bytes per entry of levels[0], a multiple of bs.
+    long block;
+    /// Length of the data in bytes.
+    long n;
+    std::vector<std::vector<block_stats_t> > levels;
+
+    entropy_pyramid_t() : bs(0), block(0), n(0) {}
+
+    bool isValid() const { return !levels.empty(); }
+
+    long bytes() const;
+};
+
+/// sample_budget_t decides how many tuples a view may count within its frame time budget, from the costs measured
+/// on its previous counts, so that a large range is first shown from a sample and a small one is counted exactly.
+struct sample_budget_t {
+    /// Time allowed for a count on the GUI thread, in nanoseconds.
+    double budget_ns;
+    /// Measured nanoseconds per tuple of an exact count, which reads the data in order.
+    double exact_ns;
+    /// Measured nanoseconds per tuple of a sampled count, which reads it at random.
+    double sample_ns;
+
+    sample_budget_t(double budget_ms = 40., double exact_ns = 2., double sample_ns = 50.)
+            : budget_ns(budget_ms * 1e6), exact_ns(exact_ns), sample_ns(sample_ns) {}
+
+    long samples(long n_tuples) const;
+
+    void record_exact(long n_tuples, double ns);
+
+    void record_sampled(long n_samples, double ns);
+};
+
 histo_dtype_t string_to_histo_dtype(const std::string &s);
 
-int *generate_histo_2d(const unsigned char *dat_u8, long n, histo_dtype_t dtype);
+long histo_dtype_size(histo_dtype_t dtype);
+
+int *generate_histo_2d(const unsigned char *dat_u8, long n, histo_dtype_t dtype, const calc_opts_t &opts = calc_opts_t());
+
+void generate_histo_3d_into(int *hist, const unsigned char *dat_u8, long n, histo_dtype_t dtype, bool overlap = true,
+                            const calc_opts_t &opts = calc_opts_t());
+
+void generate_histo_3d_sparse(sparse_histo_t &hist, const unsigned char *dat_u8, long n, histo_dtype_t dtype,
+                              bool overlap = true, const calc_opts_t &opts = calc_opts_t());
+
+int *generate_histo_2d_sampled(const unsigned char *dat_u8, long n, histo_dtype_t dtype, long n_samples,
+                               double &frac);
+
+void generate_histo_3d_sparse_sampled(sparse_histo_t &hist, const unsigned char *dat_u8, long n, histo_dtype_t dtype,
+                                      bool overlap, long n_samples, double &frac);
+
+float sampled_relative_error(double frac, double count);
+
+bool update_histo_2d(int *hist, const unsigned char *old_dat, long old_n, const unsigned char *dat_u8, long n,
+                     histo_dtype_t dtype, const calc_opts_t &opts = calc_opts_t());
+
+bool update_histo_3d_sparse(sparse_histo_t &hist, const unsigned char *old_dat, long old_n,
+                            const unsigned char *dat_u8, long n, histo_dtype_t dtype, bool overlap = true,
+                            const calc_opts_t &opts = calc_opts_t());
+
+void sort_sparse_by_count(sparse_histo_t &hist);
+
+void coarsen_sparse(sparse_histo_t &out, const sparse_histo_t &hist, int shift);
+
+int *generate_histo_3d(const unsigned char *dat_u8, long n, histo_dtype_t dtype, bool overlap = true,
+                       const calc_opts_t &opts = calc_opts_t());
+
+float *generate_histo(const unsigned char *dat_u8, long n, const calc_opts_t &opts = calc_opts_t());
+
+void build_byte_index(byte_index_t &idx, const unsigned char *dat_u8, long n, const calc_opts_t &opts = calc_opts_t());
+
+float *generate_histo_indexed(const byte_index_t &idx, const unsigned char *dat_u8, long start, long end);
+
+long entropy_len(long n, int bs = 256, const calc_opts_t &opts = calc_opts_t());
+
+void generate_entropy_into(float *dd, const unsigned char *dat_u8, long n, int bs = 256,
+                           const calc_opts_t &opts = calc_opts_t());
+
+long entropy_sliding_len(long n, long step, int bs = 256);
+
+void generate_entropy_sliding_into(float *dd, const unsigned char *dat_u8, long n, long step, int bs = 256,
+                                   const calc_opts_t &opts = calc_opts_t());
+
+float *generate_entropy_sliding(const unsigned char *dat_u8, long n, long step, long &rv_len, int bs = 256,
+                                const calc_opts_t &opts = calc_opts_t());
 
-int *generate_histo_3d(const unsigned char *dat_u8, long n, histo_dtype_t dtype, bool overlap = true);
+void build_entropy_pyramid(entropy_pyramid_t &p, const unsigned char *dat_u8, long n, int bs = 256,
+                           const calc_opts_t &opts = calc_opts_t());
 
-float *generate_histo(const unsigned char *dat_u8, long n);
+void read_entropy_pyramid(const entropy_pyramid_t &p, long start, long end, long min_len,
+                          std::vector<block_stats_t> &out);
 
-float *generate_entropy(const unsigned char *dat_u8, long n, long &rv_len, int bs = 256);
+float *generate_entropy(const unsigned char *dat_u8, long n, long &rv_len, int bs = 256,
+                        const calc_opts_t &opts = calc_opts_t());
 
 #endif
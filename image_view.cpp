@@ -24,6 +24,7 @@
 
 #include "image_view.h"
 #include "bayer.h"
+#include "result_cache.h"
 
 
 ImageView::ImageView(QWidget *p)
@@ -122,6 +123,10 @@ ImageView::ImageView(QWidget *p)
     }
 }
 
+ImageView::~ImageView() {
+    render_.stop();
+}
+
 void ImageView::setImage(QImage &img) {
     img_ = img;
 
@@ -157,17 +162,28 @@ void ImageView::update_pix() {
 }
 
 
-void ImageView::setData(const unsigned char *dat, long n) {
+void ImageView::setData(const unsigned char *dat, long n, const std::string &key) {
     dat_ = dat;
     dat_n_ = n;
+    key_ = key;
 
     regen_image();
 }
 
+/// resetData forgets the current data, which is about to be unmapped, waiting for any image being rendered from it.
+void ImageView::resetData() {
+    render_.stop();
+    dat_ = nullptr;
+    dat_n_ = 0;
+    key_.clear();
+}
+
 void ImageView::regen_image() {
     parameters_changed();
 }
 
+/// parameters_changed renders the image on the thread pool, delivering it to imageReady(). The previous image is shown
+/// until then. Images are kept in the result cache, and one found there is shown at once.
 void ImageView::parameters_changed() {
     int offset = offset_->value();
     int w = width_->value();
@@ -215,12 +231,56 @@ void ImageView::parameters_changed() {
     else if (s == "Bayer 8 - 23: 3 2 1 0") t = bayer8_23;
     else t = none;
 
+    bool inverted = inverted_;
+    std::string cache_key;
+    if (!key_.empty()) {
+        cache_key = key_ + ":image:" + std::to_string(offset) + ":" + std::to_string(w) + ":" + std::to_string(t) +
+                    (inverted ? ":inverted" : "");
+        auto img = ResultCache::instance().get<QImage>(cache_key);
+        if (img) {
+            render_.cancel();
+            img_ = *img;
+            update_pix();
+            update();
+            return;
+        }
+    }
+
+    const unsigned char *dat = dat_;
+    long n = dat_n_;
+    render_.run(calc_opts_t(), [=](const calc_opts_t &opts, int gen) {
+        if (dat == nullptr) return;
+
+        QImage img = render_image(dat, n, offset, w, t);
+        if (inverted) {
+            img = img.mirrored(true);
+        }
+        if (!*opts.cancel) {
+            if (!cache_key.empty()) {
+                ResultCache::instance().put(cache_key, std::make_shared<const QImage>(img), long(img.byteCount()));
+            }
+            QMetaObject::invokeMethod(this, "imageReady", Qt::QueuedConnection, Q_ARG(int, gen), Q_ARG(QImage, img));
+        }
+    });
+}
+
+/// imageReady shows the image rendered by parameters_changed(), unless the data or parameters have changed since.
+void ImageView::imageReady(int gen, const QImage &img) {
+    if (!render_.isCurrent(gen)) return;
+
+    img_ = img;
+    update_pix();
+    update();
+}
+
+/// render_image converts the data from offset on into an image of width w, for type t.
+QImage ImageView::render_image(const unsigned char *dat, long n_dat, int offset, int w, dtype_t t) {
     QImage img;
 
     switch (t) {
         case rgb8: {
-            auto dat_u8 = dat_ + offset;
-            int n = (dat_n_ - offset) / 1 / 3;
+            auto dat_u8 = dat + offset;
+            int n = (n_dat - offset) / 1 / 3;
             img = QImage(w, n / w + 1, QImage::Format_RGB32);
             img.fill(0);
             auto p = (unsigned int *) img.bits();
@@ -234,8 +294,8 @@ void ImageView::parameters_changed() {
         }
             break;
         case rgb12: {
-            auto dat_u16 = (const unsigned short *) (dat_ + offset);
-            int n = (dat_n_ - offset) / 2 / 3;
+            auto dat_u16 = (const unsigned short *) (dat + offset);
+            int n = (n_dat - offset) / 2 / 3;
             img = QImage(w, n / w + 1, QImage::Format_RGB32);
             img.fill(0);
             auto p = (unsigned int *) img.bits();
@@ -249,8 +309,8 @@ void ImageView::parameters_changed() {
         }
             break;
         case rgb16: {
-            auto dat_u16 = (const unsigned short *) (dat_ + offset);
-            int n = (dat_n_ - offset) / 2 / 3;
+            auto dat_u16 = (const unsigned short *) (dat + offset);
+            int n = (n_dat - offset) / 2 / 3;
             img = QImage(w, n / w + 1, QImage::Format_RGB32);
             img.fill(0);
             auto p = (unsigned int *) img.bits();
@@ -264,8 +324,8 @@ void ImageView::parameters_changed() {
         }
             break;
         case rgba8: {
-            auto dat_u8 = (const unsigned char *) (dat_ + offset);
-            int n = (dat_n_ - offset) / 1 / 4;
+            auto dat_u8 = (const unsigned char *) (dat + offset);
+            int n = (n_dat - offset) / 1 / 4;
             img = QImage(w, n / w + 1, QImage::Format_RGB32);
             img.fill(0);
             auto p = (unsigned int *) img.bits();
@@ -279,8 +339,8 @@ void ImageView::parameters_changed() {
         }
             break;
         case rgba12: {
-            auto dat_u16 = (const unsigned short *) (dat_ + offset);
-            int n = (dat_n_ - offset) / 2 / 4;
+            auto dat_u16 = (const unsigned short *) (dat + offset);
+            int n = (n_dat - offset) / 2 / 4;
             img = QImage(w, n / w + 1, QImage::Format_RGB32);
             img.fill(0);
             auto p = (unsigned int *) img.bits();
@@ -294,8 +354,8 @@ void ImageView::parameters_changed() {
         }
             break;
         case rgba16: {
-            auto dat_u16 = (const unsigned short *) (dat_ + offset);
-            int n = (dat_n_ - offset) / 2 / 4;
+            auto dat_u16 = (const unsigned short *) (dat + offset);
+            int n = (n_dat - offset) / 2 / 4;
             img = QImage(w, n / w + 1, QImage::Format_RGB32);
             img.fill(0);
             auto p = (unsigned int *) img.bits();
@@ -309,8 +369,8 @@ void ImageView::parameters_changed() {
         }
             break;
         case bgr8: {
-            auto dat_u8 = (const unsigned char *) (dat_ + offset);
-            int n = (dat_n_ - offset) / 1 / 3;
+            auto dat_u8 = (const unsigned char *) (dat + offset);
+            int n = (n_dat - offset) / 1 / 3;
             img = QImage(w, n / w + 1, QImage::Format_RGB32);
             img.fill(0);
             auto p = (unsigned int *) img.bits();
@@ -324,8 +384,8 @@ void ImageView::parameters_changed() {
         }
             break;
         case bgr12: {
-            auto dat_u16 = (const unsigned short *) (dat_ + offset);
-            int n = (dat_n_ - offset) / 2 / 3;
+            auto dat_u16 = (const unsigned short *) (dat + offset);
+            int n = (n_dat - offset) / 2 / 3;
             img = QImage(w, n / w + 1, QImage::Format_RGB32);
             img.fill(0);
             auto p = (unsigned int *) img.bits();
@@ -339,8 +399,8 @@ void ImageView::parameters_changed() {
         }
             break;
         case bgr16: {
-            auto dat_u16 = (const unsigned short *) (dat_ + offset);
-            int n = (dat_n_ - offset) / 2 / 3;
+            auto dat_u16 = (const unsigned short *) (dat + offset);
+            int n = (n_dat - offset) / 2 / 3;
             img = QImage(w, n / w + 1, QImage::Format_RGB32);
             img.fill(0);
             auto p = (unsigned int *) img.bits();
@@ -354,8 +414,8 @@ void ImageView::parameters_changed() {
         }
             break;
         case bgra8: {
-            auto dat_u8 = (const unsigned char *) (dat_ + offset);
-            int n = (dat_n_ - offset) / 1 / 4;
+            auto dat_u8 = (const unsigned char *) (dat + offset);
+            int n = (n_dat - offset) / 1 / 4;
             img = QImage(w, n / w + 1, QImage::Format_RGB32);
             img.fill(0);
             auto p = (unsigned int *) img.bits();
@@ -369,8 +429,8 @@ void ImageView::parameters_changed() {
         }
             break;
         case bgra12: {
-            auto dat_u16 = (const unsigned short *) (dat_ + offset);
-            int n = (dat_n_ - offset) / 2 / 4;
+            auto dat_u16 = (const unsigned short *) (dat + offset);
+            int n = (n_dat - offset) / 2 / 4;
             img = QImage(w, n / w + 1, QImage::Format_RGB32);
             img.fill(0);
             auto p = (unsigned int *) img.bits();
@@ -384,8 +444,8 @@ void ImageView::parameters_changed() {
         }
             break;
         case bgra16: {
-            auto dat_u16 = (const unsigned short *) (dat_ + offset);
-            int n = (dat_n_ - offset) / 2 / 4;
+            auto dat_u16 = (const unsigned short *) (dat + offset);
+            int n = (n_dat - offset) / 2 / 4;
             img = QImage(w, n / w + 1, QImage::Format_RGB32);
             img.fill(0);
             auto p = (unsigned int *) img.bits();
@@ -399,8 +459,8 @@ void ImageView::parameters_changed() {
         }
             break;
         case grey8: {
-            auto dat_u8 = (const unsigned char *) (dat_ + offset);
-            int n = (dat_n_ - offset) / 1;
+            auto dat_u8 = (const unsigned char *) (dat + offset);
+            int n = (n_dat - offset) / 1;
             img = QImage(w, n / w + 1, QImage::Format_RGB32);
             img.fill(0);
             auto p = (unsigned int *) img.bits();
@@ -415,8 +475,8 @@ void ImageView::parameters_changed() {
         }
             break;
         case grey12: {
-            auto dat_u16 = (const unsigned short *) (dat_ + offset);
-            int n = (dat_n_ - offset) / 2;
+            auto dat_u16 = (const unsigned short *) (dat + offset);
+            int n = (n_dat - offset) / 2;
             img = QImage(w, n / w + 1, QImage::Format_RGB32);
             img.fill(0);
             auto p = (unsigned int *) img.bits();
@@ -431,8 +491,8 @@ void ImageView::parameters_changed() {
         }
             break;
         case grey16: {
-            auto dat_u16 = (const unsigned short *) (dat_ + offset);
-            int n = (dat_n_ - offset) / 2;
+            auto dat_u16 = (const unsigned short *) (dat + offset);
+            int n = (n_dat - offset) / 2;
             img = QImage(w, n / w + 1, QImage::Format_RGB32);
             img.fill(0);
             auto p = (unsigned int *) img.bits();
@@ -470,10 +530,10 @@ void ImageView::parameters_changed() {
         case bayer8_21:
         case bayer8_22:
         case bayer8_23: {
-            int h = dat_n_ / w + 1;
+            int h = n_dat / w + 1;
             //int bayer_n = w * h;
 
-            auto dat_u8 = (const unsigned char *) (dat_ + offset);
+            auto dat_u8 = (const unsigned char *) (dat + offset);
 
             const unsigned char *bayer = dat_u8;
             auto rgb = new unsigned char[w * h * 3];
@@ -554,7 +614,7 @@ void ImageView::parameters_changed() {
             }
             bayerBG(bayer, h, w, perm, rgb);
 
-            int n = (dat_n_ - offset) / 1;
+            int n = (n_dat - offset) / 1;
             img = QImage(w, h, QImage::Format_RGB32);
             img.fill(0);
             auto p = (unsigned int *) img.bits();
@@ -571,8 +631,5 @@ void ImageView::parameters_changed() {
             abort();
     }
 
-    if (inverted_) {
-        img = img.mirrored(true);
-    }
-    setImage(img);
+    return img;
 }
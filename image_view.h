@@ -20,10 +20,14 @@
 #ifndef _IMAGE_VIEW_H_
 #define _IMAGE_VIEW_H_
 
+#include <string>
+
 #include <QLabel>
 #include <QImage>
 #include <QPixmap>
 
+#include "compute_scheduler.h"
+
 class QSpinBox;
 
 class QComboBox;
@@ -33,11 +37,16 @@ Q_OBJECT
 public:
     explicit ImageView(QWidget *p = nullptr);
 
-    ~ImageView() override = default;
+    ~ImageView() override;
+
+    /// cpu_ns returns the CPU time spent computing what it shows, in nanoseconds.
+    int64_t cpu_ns() const { return render_.cpu_ns(); }
 
 public slots:
 
-    void setData(const unsigned char *dat, long n);
+    void setData(const unsigned char *dat, long n, const std::string &key = std::string());
+
+    void resetData();
 
     void parameters_changed();
 
@@ -47,6 +56,8 @@ protected slots:
 
     void regen_image();
 
+    void imageReady(int gen, const QImage &img);
+
 protected:
     QImage img_;
     QPixmap pix_;
@@ -89,7 +100,12 @@ protected:
     QComboBox *type_;
     const unsigned char *dat_;
     long dat_n_;
+    // Result cache key of the data, or empty if its images are not to be cached
+    std::string key_;
     bool inverted_;
+    ComputeScheduler render_;
+
+    static QImage render_image(const unsigned char *dat, long n_dat, int offset, int w, dtype_t t);
 };
 
 #endif
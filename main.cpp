@@ -21,6 +21,7 @@
 #include <qfile.h>
 #include <qtextstream.h>
 
+#include "histogram_3d_export.h"
 #include "main_app.h"
 #include "version.h"
 
@@ -33,6 +34,12 @@ int main(int argc, char *argv[]) {
     QCoreApplication::setOrganizationDomain("confluencerd.com");
     QCoreApplication::setApplicationName("binary_viewer");
 
+    // Batch export of 3D histogram images, without a window
+    QStringList args = app.arguments();
+    if (args.size() > 1 && args[1] == "--export-3d") {
+        return export_3d_images(args.mid(2));
+    }
+
 #if 1
     QFile f(":/qdarkstyle/style.qss");
 
@@ -47,13 +54,13 @@ int main(int argc, char *argv[]) {
 
     MainApp a;
 
-    if (argc > 2) {
-        fprintf(stderr, "usage: %s <filename>\n", argv[0]);
-        exit(EXIT_FAILURE);
-    }
-
-    if (argc == 2) {
-        if (!a.load_file(argv[1])) {
+    // Any number of files may be given, which are browsed with Prev and Next
+    if (argc > 1) {
+        QStringList files;
+        for (int i = 1; i < argc; i++) {
+            files << argv[i];
+        }
+        if (!a.load_files(files)) {
             exit(EXIT_FAILURE);
         }
     }
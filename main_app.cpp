@@ -21,8 +21,10 @@
 #include <cstdlib>
 
 #include <QtGui>
+#include <QCheckBox>
 #include <QComboBox>
 #include <QFileDialog>
+#include <QFileInfo>
 #include <QGridLayout>
 #include <QHBoxLayout>
 #include <QPushButton>
@@ -37,12 +39,25 @@
 #include "histogram_3d_view.h"
 #include "plot_view.h"
 #include "histogram_calc.h"
+#include "prefetcher.h"
+#include "result_cache.h"
+#include "thread_pool.h"
 
 static int scroller_w = 16 * 8;
 
+// Interval between reports of the views' CPU use
+static const int cpu_report_ms = 2000;
+
 
 MainApp::MainApp(QWidget *p)
-        : QDialog(p), cur_file_(-1), bin_(nullptr), bin_len_(0), start_(0), end_(0) {
+        : QDialog(p), cpu_last_process_(0), cur_file_(-1), bin_(nullptr), bin_len_(0), start_(0), end_(0), range_pending_(false),
+          loader_(nullptr), load_gen_(0) {
+    qRegisterMetaType<QVector<float> >("QVector<float>");
+
+    ResultCache::instance().setBudget(QSettings().value("cache_budget_mb", 256).toLongLong() << 20);
+
+    prefetcher_ = new Prefetcher(this);
+
     done_flag_ = false;
 
     auto top_layout = new QGridLayout;
@@ -67,6 +82,15 @@ MainApp::MainApp(QWidget *p)
             connect(pb, SIGNAL(clicked()), SLOT(nextFile()));
             layout->addWidget(pb);
         }
+        {
+            QSettings settings;
+            auto cb = new QCheckBox("Sliding entropy");
+            cb->setToolTip("Plot the entropy of the window starting at every byte, rather than of disjoint blocks");
+            cb->setChecked(settings.value("sliding_entropy", false).toBool());
+            connect(cb, SIGNAL(toggled(bool)), SLOT(entropyModeChanged(bool)));
+            sliding_entropy_ = cb;
+            layout->addWidget(cb);
+        }
         top_layout->addLayout(layout, 0, 0);
     }
 
@@ -109,6 +133,11 @@ MainApp::MainApp(QWidget *p)
             filename_ = new QLabel();
             layout->addWidget(filename_);
         }
+        {
+            cpu_label_ = new QLabel();
+            cpu_label_->setToolTip("Share of a CPU used by each view, while any is in use");
+            layout->addWidget(cpu_label_);
+        }
 
         top_layout->addLayout(layout, 0, 1);
     }
@@ -134,6 +163,11 @@ MainApp::MainApp(QWidget *p)
         top_layout->addLayout(layout, 1, 1);
     }
 
+    cpu_timer_ = new QTimer(this);
+    cpu_timer_->setInterval(cpu_report_ms);
+    connect(cpu_timer_, SIGNAL(timeout()), SLOT(reportCpu()));
+    connect(histogram_3d_, SIGNAL(animating()), SLOT(watchCpu()));
+
     switchView(-1);
 
     setLayout(top_layout);
@@ -145,17 +179,89 @@ MainApp::~MainApp() {
 
 void MainApp::resizeEvent(QResizeEvent *e) {
     QDialog::resizeEvent(e);
+    update_prefetch_view();
     update_views();
 }
 
+/// update_prefetch_view passes the current overview parameters to the prefetcher.
+void MainApp::update_prefetch_view() {
+    prefetcher_->setView(overall_primary_->width(), overall_primary_->height(),
+                         overall_primary_->useByteClasses(), overall_primary_->useHilbertCurve());
+}
+
 void MainApp::quit() {
     if (!done_flag_) {
         done_flag_ = true;
 
+        stop_loader();
+        reset_views();
+        prefetcher_->stop();
+
         exit(EXIT_SUCCESS);
     }
 }
 
+/// reset_views has the views stop computing from the current mapping and forget it, before it is unmapped.
+void MainApp::reset_views() {
+    range_plots_.stop();
+    overall_zoomed_->resetData();
+    histogram_2d_->resetData();
+    histogram_3d_->resetData();
+    image_view_->resetData();
+    dot_plot_->resetData();
+}
+
+/// view_cpu_ns returns the CPU time used by each of views_ so far, in nanoseconds. The binary viewer does all its work
+/// while painting, and is not measured.
+std::vector<int64_t> MainApp::view_cpu_ns() const {
+    return {histogram_3d_->cpu_ns(), histogram_2d_->cpu_ns(), 0, image_view_->cpu_ns(), dot_plot_->cpu_ns()};
+}
+
+/// watchCpu starts reporting the CPU use of the views, unless already reporting, as when they may have work to do.
+void MainApp::watchCpu() {
+    if (cpu_timer_->isActive()) return;
+
+    cpu_last_process_ = process_cpu_ns();
+    cpu_last_ = view_cpu_ns();
+    cpu_clock_.start();
+    cpu_timer_->start();
+}
+
+/// reportCpu shows the share of a CPU used by the process, and by each view that used any, since the last report. A
+/// view's time is counted as each of its computations or frames ends, so reporting stops only once the whole process
+/// is idle, leaving no timer running until watchCpu() is next called.
+void MainApp::reportCpu() {
+    int64_t process = process_cpu_ns();
+    std::vector<int64_t> cpu = view_cpu_ns();
+    double wall = double(cpu_clock_.nsecsElapsed());
+    cpu_clock_.restart();
+
+    double total = (process - cpu_last_process_) / wall;
+    QStringList parts;
+    for (size_t i = 0; i < cpu.size(); i++) {
+        int64_t d = cpu[i] - cpu_last_[i];
+        if (d > 0) parts << QString("%1 %2%").arg(cur_view_->itemText(int(i))).arg(100. * d / wall, 0, 'f', 0);
+    }
+    cpu_last_process_ = process;
+    cpu_last_ = cpu;
+
+    // Below 1%, what remains is the GUI itself
+    if (total < .01) {
+        cpu_label_->setText("CPU idle");
+        cpu_timer_->stop();
+        return;
+    }
+
+    QString text = QString("CPU %1%").arg(total * 100., 0, 'f', 0);
+    if (!parts.empty()) text += ": " + parts.join(", ");
+    cpu_label_->setText(text);
+}
+
+/// range_key returns the result cache key of the current range, see cache_key().
+std::string MainApp::range_key() const {
+    return cache_key(source_key_, start_, end_);
+}
+
 void MainApp::reject() {
     quit();
 }
@@ -169,35 +275,40 @@ bool MainApp::load_file(const QString &filename) {
     }
     filename_->setText(title);
 
-    FILE *f = fopen(filename.toStdString().c_str(), "rb");
-    if (!f) {
-        fprintf(stderr, "Unable to open %s\n", filename.toStdString().c_str());
+    MappedFile f;
+    FileSummary summary;
+    update_prefetch_view();
+    bool prefetched = prefetcher_->take(filename, f, summary);
+    if (!prefetched && !f.open(filename.toStdString())) {
         return false;
     }
-    fseek(f, 0, SEEK_END);
-    long len = ftell(f);
-    fseek(f, 0, SEEK_SET);
-
-    if (bin_ != nullptr) {
-        delete[] bin_;
-        bin_ = nullptr;
-        bin_len_ = 0;
-        start_ = 0;
-        end_ = 0;
+    // The loader reads the current mapping, so it must finish before the mapping is replaced.
+    stop_loader();
+    // Keep the file being left, so that stepping back to it is immediate
+    if (bin_ != nullptr) prefetcher_->put(cur_filename_, file_, summary_);
+    // The views may hold results for the old mapping, whose address the new one can reuse
+    reset_views();
+    file_.swap(f);
+    cur_filename_ = filename;
+    {
+        // A file rewritten in place gets a new key, so results for its old contents are never shown
+        QFileInfo fi(filename);
+        source_key_ = QString("%1:%2:%3").arg(fi.absoluteFilePath()).arg(file_.size())
+                .arg(fi.lastModified().toMSecsSinceEpoch()).toStdString();
     }
+    summary_ = summary;
 
-    bin_ = new unsigned char[len];
-    bin_len_ = fread(bin_, 1, len, f);
-    fclose(f);
-
-    if (len != bin_len_) {
-        printf("premature read %ld of %ld\n", bin_len_, len);
-    }
+    bin_ = file_.data();
+    bin_len_ = file_.size();
 
     start_ = 0;
     end_ = bin_len_;
 
-    update_views();
+    if (prefetched) {
+        show_summary();
+    } else {
+        update_views();
+    }
 
     return true;
 }
@@ -236,45 +347,285 @@ void MainApp::loadFile() {
 }
 
 void MainApp::update_views(bool update_iv1) {
+    watchCpu();
+
     if (update_iv1) overall_primary_->clear();
 
     if (bin_ == nullptr) return;
 
     // iv1 shows the entire file, iv2 shows the current segment
-    if (update_iv1) overall_primary_->set_data(bin_ + 0, bin_len_);
-    overall_zoomed_->set_data(bin_ + start_, end_ - start_);
+    if (update_iv1) {
+        // The overview, entropy and histogram are computed in the background and painted as they arrive;
+        // fileLoaded() updates the remaining views.
+        start_loader();
+        return;
+    }
 
-    {
-        long n;
-        auto dd = generate_entropy(bin_ + start_, end_ - start_, n);
+    calc_opts_t opts = stream_opts(file_);
+
+    file_.advise(MappedFile::sequential, start_, end_ - start_);
+    overall_zoomed_->set_data(bin_ + start_, end_ - start_, true, opts, range_key());
+
+    plot_range(opts, true);
+
+    update_detail_views(opts);
+}
+
+void MainApp::update_detail_views(const calc_opts_t &opts) {
+    // The binary view and dot plot touch the range sparsely; read-ahead would only evict useful pages.
+    if (binary_viewer_->isVisible() || dot_plot_->isVisible()) {
+        file_.advise(MappedFile::random, start_, end_ - start_);
+    }
+
+    if (histogram_3d_->isVisible()) histogram_3d_->setData(bin_ + start_, end_ - start_, opts, range_key());
+    if (histogram_2d_->isVisible()) histogram_2d_->setData(bin_ + start_, end_ - start_, opts, range_key());
+    if (binary_viewer_->isVisible()) {
+//        binary_viewer_->setData(bin_ + start_, end_ - start_);
+        binary_viewer_->setData(bin_, end_);
+        binary_viewer_->setStart(start_ / 16);
+    }
+    if (image_view_->isVisible()) image_view_->setData(bin_ + start_, end_ - start_, range_key());
+    if (dot_plot_->isVisible()) dot_plot_->setData(bin_ + start_, end_ - start_);
+}
+
+/// start_loader restarts the background analysis of the current file, abandoning any analysis in progress.
+void MainApp::start_loader() {
+    stop_loader();
+    summary_ = FileSummary();
+
+    calc_opts_t opts = stream_opts(file_);
+
+    overall_primary_->set_source(bin_, bin_len_, true, opts);
+    file_.advise(MappedFile::sequential);
+
+    loader_ = new FileLoader(++load_gen_, bin_, bin_len_, start_, end_,
+                             overall_primary_->width(), overall_primary_->height(),
+                             overall_primary_->useByteClasses(), overall_primary_->useHilbertCurve(),
+                             opts, this);
+    loader_->setCacheFile(cur_filename_);
+    connect(loader_, SIGNAL(overviewProgress(int, QImage)), SLOT(overviewProgress(int, QImage)));
+    connect(loader_, SIGNAL(entropyProgress(int, QVector<float>, long)), SLOT(entropyProgress(int, QVector<float>, long)));
+    connect(loader_, SIGNAL(histogramReady(int, QVector<float>)), SLOT(histogramReady(int, QVector<float>)));
+    connect(loader_, SIGNAL(loaded(int)), SLOT(fileLoaded(int)));
+    loader_->start();
+}
+
+/// stop_loader cancels the background analysis, if any, and waits for it to finish with the file.
+void MainApp::stop_loader() {
+    if (loader_ == nullptr) return;
+
+    loader_->cancel();
+    loader_->wait();
+    delete loader_;
+    loader_ = nullptr;
+}
+
+/// is_current returns whether a result of loader generation gen still applies. Results already queued when their
+/// loader was replaced, or for a range since changed by the user, are discarded.
+bool MainApp::is_current(int gen) const {
+    return loader_ != nullptr && gen == load_gen_ &&
+           loader_->rangeStart() == long(start_) && loader_->rangeEnd() == long(end_);
+}
+
+void MainApp::overviewProgress(int gen, QImage img) {
+    if (loader_ == nullptr || gen != load_gen_) return;
+
+    overall_primary_->setImage(img);
+}
+
+void MainApp::entropyProgress(int gen, QVector<float> dd, long len) {
+    if (!is_current(gen)) return;
+
+    plot_view_->set_data(0, dd.constData(), len, true, dd.size());
+}
+
+void MainApp::histogramReady(int gen, QVector<float> dd) {
+    if (!is_current(gen)) return;
+
+    plot_view_->set_data(1, dd.constData(), 256, false);
+}
+
+void MainApp::fileLoaded(int gen) {
+    if (!is_current(gen)) return;
+
+    loader_->wait();
+    summary_ = loader_->summary();
+
+    plot_range(stream_opts(file_), false);
+    finish_load();
+}
+
+/// plot_range fills the plots of the current range, from the file summary once the loader has made one, and
+/// otherwise from the data on the thread pool, abandoning any computation still running for an earlier range.
+/// @param [in] opts Controls streaming of the data.
+/// @param [in] histogram Whether to plot the byte histogram, rather than leave it to the loader.
+void MainApp::plot_range(const calc_opts_t &opts, bool histogram) {
+    bool pyramid = summary_.pyramid.isValid() && summary_.pyramid.n == long(bin_len_);
+    bool index = summary_.index.isValid() && summary_.index.n == long(bin_len_);
+    bool sliding = sliding_entropy_->isChecked();
+
+    if (pyramid) plot_range_stats(!sliding);
+
+    if (histogram && index) {
+        // Once the file is indexed, only the ends of the range need to be read
+        auto dd = generate_histo_indexed(summary_.index, bin_, start_, end_);
         if (dd) {
-            plot_view_->set_data(0, dd, n);
+            plot_view_->set_data(1, dd, 256, false);
             delete[] dd;
         }
     }
 
-    {
-        auto dd = generate_histo(bin_ + start_, end_ - start_);
+    start_range_plots(opts, !pyramid || sliding, histogram && !index);
+}
+
+/// plot_range_stats plots the mean, minimum and maximum byte of the current range, and if entropy its entropy, read
+/// from the entropy pyramid at the resolution of the plot.
+void MainApp::plot_range_stats(bool entropy) {
+    std::vector<block_stats_t> stats;
+    read_entropy_pyramid(summary_.pyramid, start_, end_, plot_view_->height(), stats);
+    if (stats.empty()) return;
+
+    long n = stats.size();
+    std::vector<float> ent(n), mean(n), mn(n), mx(n);
+    for (long i = 0; i < n; i++) {
+        ent[i] = stats[i].entropy;
+        mean[i] = stats[i].mean / (256.f * 255.f);
+        mn[i] = stats[i].min / 255.f;
+        mx[i] = stats[i].max / 255.f;
+    }
+
+    if (entropy) plot_view_->set_data(0, ent.data(), n);
+    plot_view_->set_data(2, mean.data(), n, false, -1, mn.data(), mx.data());
+}
+
+/// start_range_plots computes the entropy and byte histogram of the current range on the thread pool, delivering
+/// them to rangeEntropyReady() and rangeHistogramReady(), unless they are in the result cache. The sliding entropy is
+/// averaged over the windows starting within each row of the plot. Any computation for an earlier range is
+/// cancelled, even if neither is wanted.
+void MainApp::start_range_plots(const calc_opts_t &opts, bool entropy, bool histogram) {
+    const unsigned char *dat = bin_ + start_;
+    long n = end_ - start_;
+    bool sliding = sliding_entropy_->isChecked();
+    long step = std::max(1L, n / std::max(1, plot_view_->height()));
+
+    ResultCache &cache = ResultCache::instance();
+    std::string entropy_key = range_key() + (sliding ? ":sliding_entropy:" + std::to_string(step) : ":entropy");
+    std::string histogram_key = range_key() + ":histogram";
+    if (entropy) {
+        auto dd = cache.get<QVector<float> >(entropy_key);
         if (dd) {
-            plot_view_->set_data(1, dd, 256, false);
-            delete[] dd;
+            plot_view_->set_data(0, dd->constData(), dd->size());
+            entropy = false;
+        }
+    }
+    if (histogram) {
+        auto dd = cache.get<QVector<float> >(histogram_key);
+        if (dd) {
+            plot_view_->set_data(1, dd->constData(), 256, false);
+            histogram = false;
         }
     }
 
-    if (histogram_3d_->isVisible()) histogram_3d_->setData(bin_ + start_, end_ - start_);
-    if (histogram_2d_->isVisible()) histogram_2d_->setData(bin_ + start_, end_ - start_);
-    if (binary_viewer_->isVisible()) {
-//        binary_viewer_->setData(bin_ + start_, end_ - start_);
-        binary_viewer_->setData(bin_, end_);
-        binary_viewer_->setStart(start_ / 16);
+    if (!entropy && !histogram) {
+        range_plots_.cancel();
+        return;
     }
-    if (image_view_->isVisible()) image_view_->setData(bin_ + start_, end_ - start_);
-    if (dot_plot_->isVisible()) dot_plot_->setData(bin_ + start_, end_ - start_);
+
+    range_plots_.run(opts, [=, &cache](const calc_opts_t &o, int gen) {
+        if (entropy) {
+            long len;
+            float *dd = sliding ? generate_entropy_sliding(dat, n, step, len, 256, o)
+                                : generate_entropy(dat, n, len, 256, o);
+            if (dd && !*o.cancel) {
+                QVector<float> v(int(len));
+                std::copy(dd, dd + len, v.begin());
+                cache.put(entropy_key, std::make_shared<const QVector<float> >(v), len * long(sizeof(float)));
+                QMetaObject::invokeMethod(this, "rangeEntropyReady", Qt::QueuedConnection,
+                                          Q_ARG(int, gen), Q_ARG(QVector<float>, v));
+            }
+            delete[] dd;
+        }
+
+        if (histogram && !*o.cancel) {
+            float *dd = generate_histo(dat, n, o);
+            if (dd && !*o.cancel) {
+                QVector<float> v(256);
+                std::copy(dd, dd + 256, v.begin());
+                cache.put(histogram_key, std::make_shared<const QVector<float> >(v), 256 * long(sizeof(float)));
+                QMetaObject::invokeMethod(this, "rangeHistogramReady", Qt::QueuedConnection,
+                                          Q_ARG(int, gen), Q_ARG(QVector<float>, v));
+            }
+            delete[] dd;
+        }
+    });
+}
+
+void MainApp::rangeEntropyReady(int gen, QVector<float> dd) {
+    if (!range_plots_.isCurrent(gen)) return;
+
+    plot_view_->set_data(0, dd.constData(), dd.size());
+}
+
+void MainApp::rangeHistogramReady(int gen, QVector<float> dd) {
+    if (!range_plots_.isCurrent(gen)) return;
+
+    plot_view_->set_data(1, dd.constData(), 256, false);
+}
+
+void MainApp::entropyModeChanged(bool v) {
+    QSettings settings;
+    settings.setValue("sliding_entropy", v);
+
+    // Otherwise the loader is still running, and the mode is applied once it finishes
+    if (bin_ != nullptr && summary_.pyramid.isValid()) plot_range(stream_opts(file_), false);
+}
+
+/// show_summary displays the prefetched analysis of the current file in place of running the loader.
+void MainApp::show_summary() {
+    // Anything still queued by an earlier loader is stale
+    load_gen_++;
+
+    overall_primary_->set_source(bin_, bin_len_, true, stream_opts(file_));
+    overall_primary_->setImage(summary_.overview);
+    plot_range(stream_opts(file_), false);
+    plot_view_->set_data(1, summary_.histogram.constData(), 256, false);
+
+    finish_load();
+}
+
+/// finish_load updates the views that depend on the overview and starts prefetching the neighbouring files.
+void MainApp::finish_load() {
+    calc_opts_t opts = stream_opts(file_);
+
+    if (start_ == 0 && end_ == bin_len_) {
+        // The segment is the whole file, whose overview has just been drawn
+        overall_zoomed_->set_source(bin_, bin_len_, true, opts);
+        QImage img = overall_primary_->image();
+        overall_zoomed_->setImage(img);
+    } else {
+        file_.advise(MappedFile::sequential, start_, end_ - start_);
+        overall_zoomed_->set_data(bin_ + start_, end_ - start_, true, opts, range_key());
+    }
+
+    update_detail_views(opts);
+
+    prefetcher_->setCurrent(files_, cur_file_);
 }
 
 void MainApp::rangeSelected(float s, float e) {
     start_ = s * bin_len_;
     end_ = e * bin_len_;
+
+    // Selections made while the views were busy are queued up behind one another; only the newest is shown
+    if (!range_pending_) {
+        range_pending_ = true;
+        QTimer::singleShot(0, this, SLOT(updateRange()));
+    }
+}
+
+/// updateRange updates the views for the newest selection.
+void MainApp::updateRange() {
+    range_pending_ = false;
     update_views(false);
 }
 
@@ -21,6 +21,14 @@
 #define _MAIN_APP_H_
 
 #include <QDialog>
+#include <QElapsedTimer>
+#include <QImage>
+#include <QVector>
+
+#include "compute_scheduler.h"
+#include "file_loader.h"
+#include "histogram_calc.h"
+#include "mapped_file.h"
 
 class OverallView;
 
@@ -30,16 +38,22 @@ class ImageView;
 
 class BinaryViewer;
 
+class Prefetcher;
+
 class DotPlot;
 
 class Histogram3dView;
 
 class PlotView;
 
+class QCheckBox;
+
 class QComboBox;
 
 class QLabel;
 
+class QTimer;
+
 class MainApp : public QDialog {
 Q_OBJECT
 public:
@@ -69,8 +83,29 @@ protected slots:
 
     bool nextFile();
 
+    void overviewProgress(int gen, QImage img);
+
+    void entropyProgress(int gen, QVector<float> dd, long len);
+
+    void histogramReady(int gen, QVector<float> dd);
+
+    void fileLoaded(int gen);
+
+    void entropyModeChanged(bool);
+
+    void updateRange();
+
+    void rangeEntropyReady(int gen, QVector<float> dd);
+
+    void rangeHistogramReady(int gen, QVector<float> dd);
+
+    void watchCpu();
+
+    void reportCpu();
+
 protected:
     QComboBox *cur_view_;
+    QCheckBox *sliding_entropy_;
     std::vector<QWidget *> views_;
 
     OverallView *overall_primary_;
@@ -83,22 +118,67 @@ protected:
     Histogram3dView *histogram_3d_;
 
     QLabel *filename_;
+    // CPU use of the views, reported while there is any
+    QLabel *cpu_label_;
+    QTimer *cpu_timer_;
+    QElapsedTimer cpu_clock_;
+    int64_t cpu_last_process_;
+    std::vector<int64_t> cpu_last_;
     QStringList files_;
     int cur_file_;
 
-    unsigned char *bin_;
+    MappedFile file_;
+    const unsigned char *bin_;
     size_t bin_len_;
 
     bool done_flag_;
 
     size_t start_;
     size_t end_;
+    // Whether updateRange() is queued for a selection not yet shown
+    bool range_pending_;
+    // The plots of the current range not given by summary_
+    ComputeScheduler range_plots_;
+
+    FileLoader *loader_;
+    int load_gen_;
+    QString cur_filename_;
+    // Identifies the current file and version of it to the result cache
+    std::string source_key_;
+    FileSummary summary_;
+    Prefetcher *prefetcher_;
 
 //    void updatePositions(bool resized = false);
 
     void resizeEvent(QResizeEvent *e) override;
 
     void update_views(bool update_iv1 = true);
+
+    void update_detail_views(const calc_opts_t &opts);
+
+    void show_summary();
+
+    void plot_range(const calc_opts_t &opts, bool histogram);
+
+    void plot_range_stats(bool entropy);
+
+    void start_range_plots(const calc_opts_t &opts, bool entropy, bool histogram);
+
+    void finish_load();
+
+    void update_prefetch_view();
+
+    void start_loader();
+
+    void stop_loader();
+
+    void reset_views();
+
+    std::string range_key() const;
+
+    std::vector<int64_t> view_cpu_ns() const;
+
+    bool is_current(int gen) const;
 };
 
 #endif
@@ -0,0 +1,272 @@
+/*
+ * Copyright (c) 2015, 2017, 2020 Kent A. Vander Velden, kent.vandervelden@gmail.com
+ *
+ * This file is part of BinVis.
+ *
+ *     BinVis is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     BinVis is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with BinVis.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <utility>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "mapped_file.h"
+
+// Stands in for the data of an empty file, which cannot be mapped.
+static const unsigned char empty_file = 0;
+
+MappedFile::MappedFile()
+        : dat_(nullptr), len_(0), heap_(false)
+#if defined(_WIN32)
+        , file_h_(INVALID_HANDLE_VALUE), map_h_(nullptr)
+#else
+        , fd_(-1)
+#endif
+{
+}
+
+MappedFile::~MappedFile() {
+    close();
+}
+
+/// open maps filename read-only, replacing any previously opened file.
+/// If the file cannot be mapped, e.g. it is a pipe or a special file, it is read into memory instead.
+/// @param [in] filename The file to open.
+/// @return Whether the file could be opened.
+bool MappedFile::open(const std::string &filename) {
+    close();
+
+#if defined(_WIN32)
+    HANDLE fh = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (fh != INVALID_HANDLE_VALUE) {
+        LARGE_INTEGER sz;
+        if (GetFileSizeEx(fh, &sz)) {
+            // long is 32 bits on Windows, so larger files cannot be addressed through size(), nor read below
+            if (sz.QuadPart > LONG_MAX) {
+                CloseHandle(fh);
+                fprintf(stderr, "Unable to open %s, files of 2 GB or more are not supported\n", filename.c_str());
+                return false;
+            }
+            if (sz.QuadPart == 0) {
+                CloseHandle(fh);
+                dat_ = &empty_file;
+                len_ = 0;
+                return true;
+            }
+            HANDLE mh = CreateFileMappingA(fh, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (mh != nullptr) {
+                void *p = MapViewOfFile(mh, FILE_MAP_READ, 0, 0, 0);
+                if (p != nullptr) {
+                    file_h_ = fh;
+                    map_h_ = mh;
+                    dat_ = (const unsigned char *) p;
+                    len_ = long(sz.QuadPart);
+                    return true;
+                }
+                CloseHandle(mh);
+            }
+        }
+        CloseHandle(fh);
+    }
+#else
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        struct stat st;
+        bool stat_ok = fstat(fd, &st) == 0;
+        // A directory opens, and would be read below as an empty file
+        if (stat_ok && S_ISDIR(st.st_mode)) {
+            ::close(fd);
+            fprintf(stderr, "Unable to open %s, it is a directory\n", filename.c_str());
+            return false;
+        }
+        if (stat_ok && S_ISREG(st.st_mode)) {
+            if (st.st_size == 0) {
+                ::close(fd);
+                dat_ = &empty_file;
+                len_ = 0;
+                return true;
+            }
+            void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                // The descriptor is kept to drop cached pages in release()
+                fd_ = fd;
+                dat_ = (const unsigned char *) p;
+                len_ = long(st.st_size);
+                return true;
+            }
+        }
+        ::close(fd);
+    }
+#endif
+
+    // Fall back to reading the whole file.
+    FILE *f = fopen(filename.c_str(), "rb");
+    if (!f) {
+        fprintf(stderr, "Unable to open %s\n", filename.c_str());
+        return false;
+    }
+
+    // The buffer grows to at most LONG_MAX bytes, only 2 GB where long is 32 bits, as on Windows
+    long cap = 1 << 20;
+    long len = 0;
+    auto buf = new unsigned char[cap];
+    for (;;) {
+        len += long(fread(buf + len, 1, cap - len, f));
+        if (len < cap) break;
+        if (cap == LONG_MAX) {
+            delete[] buf;
+            fclose(f);
+            fprintf(stderr, "Unable to read %s, it is too large\n", filename.c_str());
+            return false;
+        }
+        long new_cap = cap > LONG_MAX / 2 ? LONG_MAX : cap * 2;
+        auto tmp = new unsigned char[new_cap];
+        memcpy(tmp, buf, len);
+        delete[] buf;
+        buf = tmp;
+        cap = new_cap;
+    }
+    bool failed = ferror(f);
+    fclose(f);
+    if (failed) {
+        delete[] buf;
+        fprintf(stderr, "Unable to read %s\n", filename.c_str());
+        return false;
+    }
+
+    dat_ = buf;
+    len_ = len;
+    heap_ = true;
+
+    return true;
+}
+
+/// close unmaps the current file, invalidating all pointers previously returned by data().
+void MappedFile::close() {
+    if (dat_ == nullptr) return;
+
+    if (heap_) {
+        delete[] dat_;
+    } else if (dat_ != &empty_file) {
+#if defined(_WIN32)
+        UnmapViewOfFile(dat_);
+        CloseHandle(map_h_);
+        CloseHandle(file_h_);
+        map_h_ = nullptr;
+        file_h_ = INVALID_HANDLE_VALUE;
+#else
+        munmap((void *) dat_, len_);
+        ::close(fd_);
+        fd_ = -1;
+#endif
+    }
+
+    dat_ = nullptr;
+    len_ = 0;
+    heap_ = false;
+}
+
+/// swap exchanges the files held by this and o.
+void MappedFile::swap(MappedFile &o) {
+    std::swap(dat_, o.dat_);
+    std::swap(len_, o.len_);
+    std::swap(heap_, o.heap_);
+#if defined(_WIN32)
+    std::swap(file_h_, o.file_h_);
+    std::swap(map_h_, o.map_h_);
+#else
+    std::swap(fd_, o.fd_);
+#endif
+}
+
+/// advise tells the OS how the range [offset, offset + len) is about to be accessed, so that it can read ahead
+/// aggressively for the sequential scans of the overview and analysis kernels, or avoid wasted read-ahead for the
+/// scattered accesses of the binary and dot plot views.
+/// @param [in] access The expected access pattern.
+/// @param [in] offset Start of the range in bytes.
+/// @param [in] len Length of the range in bytes, or -1 for the remainder of the file.
+void MappedFile::advise(access_t access, long offset, long len) const {
+#if !defined(_WIN32)
+    if (dat_ == nullptr || heap_ || len_ == 0) return;
+
+    if (len < 0 || offset + len > len_) len = len_ - offset;
+    if (offset < 0 || len <= 0) return;
+
+    // madvise requires a page aligned start
+    long ps = sysconf(_SC_PAGESIZE);
+    long s = offset - offset % ps;
+
+    int advice = MADV_NORMAL;
+    switch (access) {
+        case normal:
+            advice = MADV_NORMAL;
+            break;
+        case sequential:
+            advice = MADV_SEQUENTIAL;
+            break;
+        case random:
+            advice = MADV_RANDOM;
+            break;
+    }
+    madvise((void *) (dat_ + s), offset + len - s, advice);
+#else
+    (void) access;
+    (void) offset;
+    (void) len;
+#endif
+}
+
+/// release tells the OS that the pages within [p, p + len) are no longer needed. They are dropped from the process
+/// and the page cache, and are transparently read again if touched later, so a streaming scan of a file larger than
+/// memory keeps only its current window resident. Only pages entirely within the range are released.
+/// @param [in] p Start of the range, which must lie within data().
+/// @param [in] len Length of the range in bytes.
+void MappedFile::release(const unsigned char *p, long len) const {
+    if (dat_ == nullptr || heap_ || len_ == 0) return;
+    if (p < dat_ || p + len > dat_ + len_ || len <= 0) return;
+
+#if defined(_WIN32)
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    long ps = si.dwPageSize;
+#else
+    long ps = sysconf(_SC_PAGESIZE);
+#endif
+
+    long s = p - dat_;
+    long e = s + len;
+    s = (s + ps - 1) / ps * ps;
+    if (e != len_) e = e / ps * ps;
+    if (s >= e) return;
+
+#if defined(_WIN32)
+    // Unlocking pages that are not locked removes them from the working set.
+    VirtualUnlock((void *) (dat_ + s), e - s);
+#else
+    madvise((void *) (dat_ + s), e - s, MADV_DONTNEED);
+#if defined(POSIX_FADV_DONTNEED)
+    posix_fadvise(fd_, s, e - s, POSIX_FADV_DONTNEED);
+#endif
+#endif
+}
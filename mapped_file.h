@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2015, 2017, 2020 Kent A. Vander Velden, kent.vandervelden@gmail.com
+ *
+ * This file is part of BinVis.
+ *
+ *     BinVis is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     BinVis is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with BinVis.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MAPPED_FILE_H_
+#define _MAPPED_FILE_H_
+
+#include <string>
+
+/// MappedFile is a read-only, memory-mapped view of a file. Pages are faulted in by the OS as the views touch them,
+/// so opening is independent of the file length and only the ranges actually examined become resident.
+class MappedFile {
+public:
+    typedef enum {
+        normal, sequential, random
+    } access_t;
+
+    MappedFile();
+
+    ~MappedFile();
+
+    MappedFile(const MappedFile &) = delete;
+
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    bool open(const std::string &filename);
+
+    void close();
+
+    void swap(MappedFile &o);
+
+    bool isOpen() const { return dat_ != nullptr; }
+
+    const unsigned char *data() const { return dat_; }
+
+    long size() const { return len_; }
+
+    void advise(access_t access, long offset = 0, long len = -1) const;
+
+    void release(const unsigned char *p, long len) const;
+
+protected:
+    const unsigned char *dat_;
+    long len_;
+    bool heap_;
+
+#if defined(_WIN32)
+    void *file_h_;
+    void *map_h_;
+#else
+    int fd_;
+#endif
+};
+
+#endif
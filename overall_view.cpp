@@ -21,43 +21,26 @@
 
 #include "hilbert.h"
 #include "overall_view.h"
+#include "result_cache.h"
 
 using std::min;
 
-OverallView::OverallView(QWidget *p)
-        : QLabel(p),
-          m1_(0.), m2_(1.), px_(-1), py_(-1), s_(none), allow_selection_(true),
-          use_byte_classes_(true),
-          use_hilbert_curve_(true),
-          dat_(nullptr), len_(0) {
-}
-
-void OverallView::enableSelection(bool v) {
-    allow_selection_ = v;
-    update();
-}
-
-void OverallView::setImage(QImage &img) {
-    img_ = img;
-
-    update_pix();
-
-    update();
-}
-
-void OverallView::set_data(const unsigned char *dat, long len, bool reset_selection) {
-    dat_ = dat;
-    len_ = len;
-
-    if (reset_selection) {
-        m1_ = 0.;
-        m2_ = 1.;
-    }
-
-    int w = width();
-    int h = height();
+/// render_overview draws an image summarizing [dat, dat + len), mapping runs of bytes to pixels along a
+/// Hilbert curve or in raster order. It may be called from any thread.
+/// @param [in] dat Byte data to be summarized.
+/// @param [in] len Length of dat in bytes.
+/// @param [in] w Width of the view the image is intended for.
+/// @param [in] h Height of the view the image is intended for.
+/// @param [in] use_byte_classes Whether to colour by byte class (true) or by mean byte value (false).
+/// @param [in] use_hilbert_curve Whether to lay out the pixels along a Hilbert curve.
+/// @param [in] opts Controls streaming and cancellation of dat.
+/// @param [in] progress If set, called with the partially drawn image after each window of opts.window bytes;
+///                      returning false abandons the image.
+/// @return The overview, or a null image if abandoned.
+QImage render_overview(const unsigned char *dat, long len, int w, int h, bool use_byte_classes, bool use_hilbert_curve,
+                       const calc_opts_t &opts, const std::function<bool(const QImage &)> &progress) {
     int wh = w * h;
-    int sf = len / wh + 1;
+    long sf = len / wh + 1;
 
     int img_w = w, img_h = len / sf / w + 1;
     QImage img(img_w, img_h, QImage::Format_RGB32);
@@ -66,15 +49,18 @@ void OverallView::set_data(const unsigned char *dat, long len, bool reset_select
 
     curve_t hilbert;
     int h_ind = 0;
-    if (use_hilbert_curve_) gilbert2d(img_w, img_h, hilbert);
+    if (use_hilbert_curve) gilbert2d(img_w, img_h, hilbert);
 
     auto p = (unsigned int *) img.bits();
 
-    for (int i = 0; i < len;) {
+    // start of the window not yet handed back to opts.release
+    long win_s = 0;
+
+    for (long i = 0; i < len;) {
         int r = 0, g = 0, b = 0;
 
-        if (!use_byte_classes_) {
-            int cn = 0;
+        if (!use_byte_classes) {
+            long cn = 0;
             int j;
             for (j = 0; i < len && j < sf; i++, j++) {
                 cn += dat[i];
@@ -120,7 +106,7 @@ void OverallView::set_data(const unsigned char *dat, long len, bool reset_select
 
         unsigned int v = 0xff000000 | (r << 16) | (g << 8) | (b << 0);
 
-        if (!use_hilbert_curve_) {
+        if (!use_hilbert_curve) {
             *p++ = v;
         } else {
             if (h_ind >= hilbert.size()) abort();
@@ -134,10 +120,109 @@ void OverallView::set_data(const unsigned char *dat, long len, bool reset_select
                 abort();
             }
         }
+
+        if (opts.window > 0 && i - win_s >= opts.window) {
+            if (opts.release) opts.release(dat + win_s, i - win_s);
+            win_s = i;
+            if (opts.cancel && *opts.cancel) return QImage();
+            if (progress && !progress(img)) return QImage();
+        }
+    }
+    if (opts.release) opts.release(dat + win_s, len - win_s);
+
+    return img;
+}
+
+OverallView::OverallView(QWidget *p)
+        : QLabel(p),
+          m1_(0.), m2_(1.), px_(-1), py_(-1), s_(none), allow_selection_(true),
+          use_byte_classes_(true),
+          use_hilbert_curve_(true),
+          dat_(nullptr), len_(0) {
+}
+
+OverallView::~OverallView() {
+    render_.stop();
+}
+
+void OverallView::enableSelection(bool v) {
+    allow_selection_ = v;
+    update();
+}
+
+void OverallView::setImage(QImage &img) {
+    img_ = img;
+
+    update_pix();
+
+    update();
+}
+
+/// set_source records the data summarized by the view without drawing it; the image is supplied with setImage().
+void OverallView::set_source(const unsigned char *dat, long len, bool reset_selection, const calc_opts_t &opts) {
+    // An image still being rendered by set_data() is of the previous source
+    render_.cancel();
+    dat_ = dat;
+    len_ = len;
+    opts_ = opts;
+
+    if (reset_selection) {
+        m1_ = 0.;
+        m2_ = 1.;
+    }
+}
+
+/// set_data renders the overview of dat on the thread pool, delivering it to imageReady(). The previous image is shown
+/// until then. If key is given, the images are kept in the result cache, and one found there is shown at once.
+void OverallView::set_data(const unsigned char *dat, long len, bool reset_selection, const calc_opts_t &opts,
+                           const std::string &key) {
+    set_source(dat, len, reset_selection, opts);
+    key_ = key;
+
+    QSize size = this->size();
+    bool use_byte_classes = use_byte_classes_;
+    bool use_hilbert_curve = use_hilbert_curve_;
+
+    std::string cache_key;
+    if (!key.empty()) {
+        cache_key = key + ":overview:" + std::to_string(size.width()) + "x" + std::to_string(size.height()) +
+                    (use_byte_classes ? ":classes" : "") + (use_hilbert_curve ? ":hilbert" : "");
+        auto img = ResultCache::instance().get<QImage>(cache_key);
+        if (img) {
+            img_ = *img;
+            update_pix();
+            update();
+            return;
+        }
     }
 
-    img = img.scaled(size());
-    setImage(img);
+    render_.run(opts, [=](const calc_opts_t &opts, int gen) {
+        QImage img = render_overview(dat, len, size.width(), size.height(), use_byte_classes, use_hilbert_curve, opts);
+        if (*opts.cancel) return;
+
+        img = img.scaled(size);
+        if (!cache_key.empty()) {
+            ResultCache::instance().put(cache_key, std::make_shared<const QImage>(img), long(img.byteCount()));
+        }
+        QMetaObject::invokeMethod(this, "imageReady", Qt::QueuedConnection, Q_ARG(int, gen), Q_ARG(QImage, img));
+    });
+}
+
+/// imageReady shows the image rendered by set_data(), unless the source has changed since.
+void OverallView::imageReady(int gen, const QImage &img) {
+    if (!render_.isCurrent(gen)) return;
+
+    img_ = img;
+    update_pix();
+    update();
+}
+
+/// resetData forgets the current data, which is about to be unmapped, waiting for any image being rendered from it.
+void OverallView::resetData() {
+    render_.stop();
+    dat_ = nullptr;
+    len_ = 0;
+    key_.clear();
 }
 
 void OverallView::paintEvent(QPaintEvent *e) {
@@ -198,7 +283,7 @@ void OverallView::mousePressEvent(QMouseEvent *e) {
         v = BinaryToGray((GrayToBinary(v) + 1) & 0x03);
         use_byte_classes_ = v & 0x02;
         use_hilbert_curve_ = v & 0x01;
-        set_data(dat_, len_, false);
+        set_data(dat_, len_, false, opts_, key_);
         return;
     }
 
@@ -20,27 +20,50 @@
 #ifndef _OVERALL_VIEW_H_
 #define _OVERALL_VIEW_H_
 
+#include <functional>
+#include <string>
+
 #include <QLabel>
 #include <QImage>
 #include <QPixmap>
 
+#include "compute_scheduler.h"
+#include "histogram_calc.h"
+
+QImage render_overview(const unsigned char *dat, long len, int w, int h, bool use_byte_classes, bool use_hilbert_curve,
+                       const calc_opts_t &opts = calc_opts_t(),
+                       const std::function<bool(const QImage &)> &progress = nullptr);
+
 class OverallView : public QLabel {
 Q_OBJECT
 public:
     explicit OverallView(QWidget *p = nullptr);
 
-    ~OverallView() override = default;
+    ~OverallView() override;
+
+    const QImage &image() const { return img_; }
+
+    bool useByteClasses() const { return use_byte_classes_; }
+
+    bool useHilbertCurve() const { return use_hilbert_curve_; }
 
 public slots:
 
     void setImage(QImage &img);
 
-    void set_data(const unsigned char *bin, long len, bool reset_selection = true);
+    void set_source(const unsigned char *bin, long len, bool reset_selection = true, const calc_opts_t &opts = calc_opts_t());
+
+    void set_data(const unsigned char *bin, long len, bool reset_selection = true, const calc_opts_t &opts = calc_opts_t(),
+                  const std::string &key = std::string());
+
+    void resetData();
 
     void enableSelection(bool);
 
 protected slots:
 
+    void imageReady(int gen, const QImage &img);
+
 protected:
     QImage img_;
     QPixmap pix_;
@@ -69,6 +92,10 @@ protected:
 
     const unsigned char *dat_;
     long len_;
+    calc_opts_t opts_;
+    // Result cache key of the data, or empty if its images are not to be cached
+    std::string key_;
+    ComputeScheduler render_;
 
 signals:
 
@@ -18,6 +18,7 @@
  */
 
 #include <algorithm>
+#include <vector>
 #include <QtGui>
 
 #include "plot_view.h"
@@ -48,16 +49,28 @@ void PlotView::set_data(const float *dat, long len, bool normalize) {
     set_data(0, dat, len, normalize);
 }
 
-void PlotView::set_data(int ind, const float *dat, long len, bool normalize) {
+/// set_data plots dat, stretched over the height of the view, into plot ind.
+/// @param [in] ind The plot to update.
+/// @param [in] dat The values to plot.
+/// @param [in] len Length of dat.
+/// @param [in] normalize Whether to scale the values to their range, or to treat them as lying in [0., 1.]
+/// @param [in] valid_len If not -1, only the first valid_len values are available yet and the rest are left blank,
+///                       so that a result can be shown while it is still being computed.
+/// @param [in] lo If not null, with hi, the bounds of a band drawn dimly behind the values, scaled as dat.
+/// @param [in] hi See lo.
+void PlotView::set_data(int ind, const float *dat, long len, bool normalize, long valid_len,
+                        const float *lo, const float *hi) {
     int w = width();
     int h = height();
 
+    if (valid_len < 0 || valid_len > len) valid_len = len;
+
     float mn = 0.;
     float mx = 1.;
     if (normalize) {
         mn = 99999999.;
         mx = -99999999.;
-        for (int i = 0; i < len; i++) {
+        for (long i = 0; i < valid_len; i++) {
             mn = min(mn, dat[i]);
             mx = max(mx, dat[i]);
         }
@@ -75,15 +88,36 @@ void PlotView::set_data(int ind, const float *dat, long len, bool normalize) {
         memset(acc, 0, h * sizeof(float));
         auto cnt = new int[h];
         memset(cnt, 0, h * sizeof(int));
+        std::vector<float> band_lo, band_hi;
+        if (lo && hi) {
+            band_lo.assign(h, 1.f);
+            band_hi.assign(h, 0.f);
+        }
 
-        for (int i = 0; i < len; i++) {
+        for (long i = 0; i < valid_len; i++) {
             float v = dat[i];
             int ind2 = int((i / float(len)) * (h - 1) + .5);
             acc[ind2] += (v - mn) / (mx - mn);
             cnt[ind2]++;
+            if (!band_lo.empty()) {
+                band_lo[ind2] = min(band_lo[ind2], (lo[i] - mn) / (mx - mn));
+                band_hi[ind2] = max(band_hi[ind2], (hi[i] - mn) / (mx - mn));
+            }
         }
 
         auto p = (unsigned int *) img.bits();
+
+        if (!band_lo.empty()) {
+            for (int i = 0; i < h; i++) {
+                if (cnt[i] == 0) continue;
+                int x1 = max(0, int(band_lo[i] * (w - 4) + .5) + 2);
+                int x2 = min(w - 1, int(band_hi[i] * (w - 4) + .5) + 2);
+                for (int x = x1; x <= x2; x++) {
+                    p[i * w + x] = 0xff000000 | (20 << 16) | (50 << 8) | 20;
+                }
+            }
+        }
+
         int px = -1;
         int pc = -1;
         for (int i = 0; i < h; i++) {
@@ -226,7 +260,7 @@ void PlotView::mouseReleaseEvent(QMouseEvent *e) {
     e->accept();
 
     if (e->button() == Qt::RightButton) {
-        ind_ = (ind_ + 1) % 2;
+        ind_ = (ind_ + 1) % 3;
         update_pix();
         update();
     }
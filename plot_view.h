@@ -37,14 +37,15 @@ public slots:
 
     void set_data(const float *bin, long len, bool normalize = true);
 
-    void set_data(int ind, const float *bin, long len, bool normalize = true);
+    void set_data(int ind, const float *bin, long len, bool normalize = true, long valid_len = -1,
+                  const float *lo = nullptr, const float *hi = nullptr);
 
     void enableSelection(bool);
 
 protected slots:
 
 protected:
-    QImage img_[2];
+    QImage img_[3];
     QPixmap pix_;
 
     void paintEvent(QPaintEvent *) override;
@@ -0,0 +1,204 @@
+/*
+ * Copyright (c) 2015, 2017, 2020 Kent A. Vander Velden, kent.vandervelden@gmail.com
+ *
+ * This file is part of BinVis.
+ *
+ *     BinVis is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     BinVis is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with BinVis.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <QFileInfo>
+#include <QSettings>
+
+#include "prefetcher.h"
+
+Prefetcher::Prefetcher(QObject *p)
+        : QObject(p), loader_(nullptr), gen_(0),
+          w_(0), h_(0), use_byte_classes_(false), use_hilbert_curve_(false) {
+}
+
+Prefetcher::~Prefetcher() {
+    stop();
+}
+
+/// setView sets the parameters overviews are drawn with. Summaries drawn with other parameters are discarded.
+void Prefetcher::setView(int w, int h, bool use_byte_classes, bool use_hilbert_curve) {
+    if (w == w_ && h == h_ && use_byte_classes == use_byte_classes_ && use_hilbert_curve == use_hilbert_curve_) return;
+
+    w_ = w;
+    h_ = h;
+    use_byte_classes_ = use_byte_classes;
+    use_hilbert_curve_ = use_hilbert_curve;
+
+    stop();
+    cache_.clear();
+    schedule();
+}
+
+/// setCurrent makes cur the file being viewed. Files beyond prefetch_count on either side of it are dropped, and the
+/// nearest ones not yet available are analyzed in turn, nearest first, while they fit within the memory budget.
+/// @param [in] files The list of files being browsed.
+/// @param [in] cur Index of the current file within files.
+void Prefetcher::setCurrent(const QStringList &files, int cur) {
+    QSettings settings;
+    int n = settings.value("prefetch_count", 2).toInt();
+
+    wanted_.clear();
+    if (cur >= 0) {
+        for (int d = 1; d <= n; d++) {
+            if (cur + d < files.size()) wanted_ << files[cur + d];
+            if (cur - d >= 0) wanted_ << files[cur - d];
+        }
+    }
+
+    for (auto it = cache_.begin(); it != cache_.end();) {
+        if (!wanted_.contains(it->first)) {
+            it = cache_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    // Evict the farthest files until within budget
+    for (int i = wanted_.size() - 1; i >= 0 && used() > budget(); i--) {
+        cache_.erase(wanted_[i]);
+    }
+
+    if (loader_ != nullptr && !wanted_.contains(loading_name_)) stop();
+
+    schedule();
+}
+
+/// stop abandons the analysis in progress, if any.
+void Prefetcher::stop() {
+    if (loader_ != nullptr) {
+        loader_->cancel();
+        loader_->wait();
+        delete loader_;
+        loader_ = nullptr;
+    }
+    loading_.reset();
+    loading_name_.clear();
+}
+
+/// take hands over a prefetched file and its summary, removing it from the cache.
+/// @param [in] filename The file wanted.
+/// @param [out] file Receives the mapping of filename.
+/// @param [out] summary Receives the analysis of filename.
+/// @return Whether filename was available. If not, file and summary are unchanged.
+bool Prefetcher::take(const QString &filename, MappedFile &file, FileSummary &summary) {
+    if (loading_name_ == filename) stop();
+
+    auto it = cache_.find(filename);
+    if (it == cache_.end()) return false;
+
+    bool rv = matches_view(it->second->summary);
+    if (rv) {
+        file.swap(it->second->file);
+        summary = it->second->summary;
+    }
+    cache_.erase(it);
+
+    return rv;
+}
+
+/// put returns a file, typically the one being left, to the cache so that stepping back to it is immediate.
+/// @param [in] filename Name of the file.
+/// @param [in,out] file The mapping of filename, which is taken over, leaving file closed.
+/// @param [in] summary The analysis of the whole of filename.
+void Prefetcher::put(const QString &filename, MappedFile &file, const FileSummary &summary) {
+    if (!summary.isValid() || !matches_view(summary)) return;
+    if (summary.start != 0 || summary.end != file.size()) return;
+
+    std::unique_ptr<entry_t> e(new entry_t);
+    e->file.swap(file);
+    e->summary = summary;
+    e->cost = cost(e->file, e->summary);
+    cache_[filename] = std::move(e);
+}
+
+void Prefetcher::schedule() {
+    if (loader_ != nullptr || w_ <= 0 || h_ <= 0) return;
+
+    long avail = budget() - used();
+
+    for (const auto &fn : wanted_) {
+        if (cache_.count(fn)) continue;
+
+        // Only regular files, reading anything else could block
+        QFileInfo fi(fn);
+        if (!fi.isFile()) continue;
+
+        std::unique_ptr<entry_t> e(new entry_t);
+        if (!e->file.open(fn.toStdString())) continue;
+
+        // The entries are in order of priority, so stop at the first that does not fit
+        FileSummary est;
+        est.overview = QImage(w_, h_, QImage::Format_RGB32);
+        if (cost(e->file, est) > avail) break;
+
+        // The options refer to the entry's file, which stays put as the entry is moved
+        calc_opts_t opts = stream_opts(e->file);
+        loader_ = new FileLoader(++gen_, e->file.data(), e->file.size(), 0, e->file.size(),
+                                 w_, h_, use_byte_classes_, use_hilbert_curve_, opts, this);
+        loader_->setReportProgress(false);
+        loader_->setCacheFile(fn);
+        connect(loader_, SIGNAL(loaded(int)), SLOT(loaderFinished(int)));
+        loading_ = std::move(e);
+        loading_name_ = fn;
+        loader_->start(QThread::LowPriority);
+        return;
+    }
+}
+
+void Prefetcher::loaderFinished(int gen) {
+    // A loader stopped after finishing may still have its signal queued
+    if (loader_ == nullptr || gen != gen_) return;
+
+    loader_->wait();
+    loading_->summary = loader_->summary();
+    loading_->cost = cost(loading_->file, loading_->summary);
+    cache_[loading_name_] = std::move(loading_);
+
+    loader_->deleteLater();
+    loader_ = nullptr;
+    loading_name_.clear();
+
+    schedule();
+}
+
+bool Prefetcher::matches_view(const FileSummary &summary) const {
+    return summary.w == w_ && summary.h == h_ &&
+           summary.use_byte_classes == use_byte_classes_ && summary.use_hilbert_curve == use_hilbert_curve_;
+}
+
+long Prefetcher::budget() const {
+    QSettings settings;
+    return settings.value("prefetch_budget_mb", 1024).toLongLong() << 20;
+}
+
+long Prefetcher::used() const {
+    long rv = 0;
+    for (const auto &j : cache_) {
+        rv += j.second->cost;
+    }
+    return rv;
+}
+
+/// cost estimates the memory held by a prefetched file: its summary, plus the file itself once read, unless it is
+/// large enough to be streamed, in which case its pages are released as it is analyzed.
+long Prefetcher::cost(const MappedFile &file, const FileSummary &summary) {
+    long rv = summary.bytes();
+    if (stream_opts(file).window == 0) rv += file.size();
+    return rv;
+}
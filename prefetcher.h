@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2015, 2017, 2020 Kent A. Vander Velden, kent.vandervelden@gmail.com
+ *
+ * This file is part of BinVis.
+ *
+ *     BinVis is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     BinVis is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with BinVis.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _PREFETCHER_H_
+#define _PREFETCHER_H_
+
+#include <map>
+#include <memory>
+
+#include <QObject>
+#include <QStringList>
+
+#include "file_loader.h"
+#include "mapped_file.h"
+
+/// Prefetcher maps and analyzes the files neighbouring the current one in the background, so that stepping through
+/// a list of files is served from memory. At most prefetch_count files on each side are kept, and only while their
+/// summaries and resident data fit within the prefetch_budget_mb setting.
+class Prefetcher : public QObject {
+Q_OBJECT
+public:
+    explicit Prefetcher(QObject *p = nullptr);
+
+    ~Prefetcher() override;
+
+    void setView(int w, int h, bool use_byte_classes, bool use_hilbert_curve);
+
+    void setCurrent(const QStringList &files, int cur);
+
+    void stop();
+
+    bool take(const QString &filename, MappedFile &file, FileSummary &summary);
+
+    void put(const QString &filename, MappedFile &file, const FileSummary &summary);
+
+protected slots:
+
+    void loaderFinished(int gen);
+
+protected:
+    struct entry_t {
+        MappedFile file;
+        FileSummary summary;
+        long cost;
+    };
+
+    void schedule();
+
+    bool matches_view(const FileSummary &summary) const;
+
+    long budget() const;
+
+    long used() const;
+
+    static long cost(const MappedFile &file, const FileSummary &summary);
+
+    std::map<QString, std::unique_ptr<entry_t> > cache_;
+    QStringList wanted_;
+
+    FileLoader *loader_;
+    std::unique_ptr<entry_t> loading_;
+    QString loading_name_;
+    int gen_;
+
+    int w_, h_;
+    bool use_byte_classes_;
+    bool use_hilbert_curve_;
+};
+
+#endif
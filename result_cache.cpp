@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2015, 2017, 2020 Kent A. Vander Velden, kent.vandervelden@gmail.com
+ *
+ * This file is part of BinVis.
+ *
+ *     BinVis is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     BinVis is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with BinVis.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "result_cache.h"
+
+ResultCache::ResultCache(long budget) : budget_(budget), used_(0) {}
+
+/// instance returns the cache shared by the whole application.
+ResultCache &ResultCache::instance() {
+    static ResultCache cache;
+    return cache;
+}
+
+/// setBudget sets the most memory the results may hold, evicting the least recently used as needed.
+void ResultCache::setBudget(long bytes) {
+    std::lock_guard<std::mutex> lk(m_);
+    budget_ = bytes;
+    evict();
+}
+
+long ResultCache::budget() const {
+    std::lock_guard<std::mutex> lk(m_);
+    return budget_;
+}
+
+long ResultCache::used() const {
+    std::lock_guard<std::mutex> lk(m_);
+    return used_;
+}
+
+void ResultCache::clear() {
+    std::lock_guard<std::mutex> lk(m_);
+    lru_.clear();
+    index_.clear();
+    used_ = 0;
+}
+
+/// find returns the result stored under key, marking it most recently used, or nullptr if there is none of type.
+std::shared_ptr<const void> ResultCache::find(const std::string &key, const std::type_info &type) {
+    std::lock_guard<std::mutex> lk(m_);
+
+    auto it = index_.find(key);
+    if (it == index_.end() || *it->second->type != type) return nullptr;
+
+    lru_.splice(lru_.begin(), lru_, it->second);
+    return it->second->v;
+}
+
+/// insert stores v under key as the most recently used result. A result larger than the whole budget is not kept.
+void ResultCache::insert(const std::string &key, std::shared_ptr<const void> v, const std::type_info &type,
+                         long bytes) {
+    std::lock_guard<std::mutex> lk(m_);
+
+    auto it = index_.find(key);
+    if (it != index_.end()) {
+        used_ -= it->second->bytes;
+        lru_.erase(it->second);
+        index_.erase(it);
+    }
+
+    if (!v || bytes > budget_) return;
+
+    lru_.push_front(entry_t{key, std::move(v), &type, bytes});
+    index_[key] = lru_.begin();
+    used_ += bytes;
+
+    evict();
+}
+
+/// evict drops the least recently used results until those left fit the budget.
+void ResultCache::evict() {
+    while (used_ > budget_ && !lru_.empty()) {
+        used_ -= lru_.back().bytes;
+        index_.erase(lru_.back().key);
+        lru_.pop_back();
+    }
+}
+
+/// cache_key returns the key for results computed from [start, end) of source, to which the kind of result and its
+/// parameters are appended.
+/// @param [in] source Identifies the file, and the version of it, the data was read from.
+std::string cache_key(const std::string &source, long start, long end) {
+    return source + ":" + std::to_string(start) + "-" + std::to_string(end);
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2015, 2017, 2020 Kent A. Vander Velden, kent.vandervelden@gmail.com
+ *
+ * This file is part of BinVis.
+ *
+ *     BinVis is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     BinVis is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with BinVis.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RESULT_CACHE_H_
+#define _RESULT_CACHE_H_
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <typeinfo>
+#include <unordered_map>
+
+/// ResultCache keeps computed results, such as histograms and rendered images, so that showing the same data with the
+/// same parameters again is served from memory. Results are keyed by a string naming the source of the data, its
+/// range and the parameters, see cache_key(), and are evicted in least recently used order once their total size
+/// exceeds the budget. It may be used from any thread.
+class ResultCache {
+public:
+    explicit ResultCache(long budget = 256L << 20);
+
+    ResultCache(const ResultCache &) = delete;
+
+    ResultCache &operator=(const ResultCache &) = delete;
+
+    static ResultCache &instance();
+
+    void setBudget(long bytes);
+
+    long budget() const;
+
+    long used() const;
+
+    /// get returns the result stored under key, or nullptr if there is none of type T.
+    template<class T>
+    std::shared_ptr<const T> get(const std::string &key) {
+        return std::static_pointer_cast<const T>(find(key, typeid(T)));
+    }
+
+    /// put stores v under key, replacing any result already there.
+    /// @param [in] bytes The memory held by v, charged against the budget.
+    template<class T>
+    void put(const std::string &key, std::shared_ptr<const T> v, long bytes) {
+        insert(key, std::move(v), typeid(T), bytes);
+    }
+
+    void clear();
+
+protected:
+    struct entry_t {
+        std::string key;
+        std::shared_ptr<const void> v;
+        const std::type_info *type;
+        long bytes;
+    };
+
+    std::shared_ptr<const void> find(const std::string &key, const std::type_info &type);
+
+    void insert(const std::string &key, std::shared_ptr<const void> v, const std::type_info &type, long bytes);
+
+    void evict();
+
+    // Most recently used first
+    std::list<entry_t> lru_;
+    std::unordered_map<std::string, std::list<entry_t>::iterator> index_;
+    long budget_;
+    long used_;
+    mutable std::mutex m_;
+};
+
+std::string cache_key(const std::string &source, long start, long end);
+
+#endif
@@ -0,0 +1,276 @@
+/*
+ * Copyright (c) 2015, 2017, 2020 Kent A. Vander Velden, kent.vandervelden@gmail.com
+ *
+ * This file is part of BinVis.
+ *
+ *     BinVis is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     BinVis is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with BinVis.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <cstdint>
+#include <cstring>
+
+#include <QDateTime>
+#include <QDir>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QSettings>
+#include <QStandardPaths>
+
+#include "mapped_file.h"
+#include "summary_cache.h"
+
+// A summary is written to disk as a summary_header_t followed by sections aligned to section_align bytes: the
+// overview pixels, the entry counts of the pyramid levels, the levels themselves, and the byte index counts. All
+// values are in the byte order of the host, which is recorded by the magic number.
+static const uint64_t summary_magic = 0x3153564e49565942ULL; // "BYVINVS1"
+static const uint32_t summary_version = 1;
+static const long section_align = 8;
+
+// Bytes hashed from each part of a file sampled to identify its contents, and the number of parts
+static const long hash_part = 64L << 10;
+static const long hash_parts = 16;
+
+struct summary_header_t {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t flags;
+    int64_t len;
+
+    // Overview, in QImage::Format_RGB32
+    int32_t w, h;
+    int64_t overview_offset;
+
+    // Entropy pyramid
+    int32_t bs;
+    int32_t n_levels;
+    int64_t pyramid_block;
+    int64_t levels_offset;
+
+    // Byte index
+    int64_t index_block;
+    int64_t index_n_counts;
+    int64_t index_offset;
+
+    int64_t total;
+};
+
+enum {
+    use_byte_classes_flag = 1, use_hilbert_curve_flag = 2
+};
+
+static long align(long n) {
+    return (n + section_align - 1) / section_align * section_align;
+}
+
+/// fits returns whether n items of size bytes, starting at off, lie within [0, end), without overflowing.
+static bool fits(int64_t off, int64_t n, int64_t size, int64_t end) {
+    return off >= 0 && n >= 0 && off <= end && n <= (end - off) / size;
+}
+
+/// hash_bytes folds n bytes of dat into the 64-bit hash h, eight bytes at a time.
+static uint64_t hash_bytes(uint64_t h, const unsigned char *dat, long n) {
+    long i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t v;
+        memcpy(&v, dat + i, 8);
+        h = (h ^ v) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 29;
+    }
+    for (; i < n; i++) {
+        h = (h ^ dat[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/// summary_cache_path returns the file holding the cached summary of filename, or an empty string if summaries are
+/// not cached. The name is made from the size and modification time of the file, and a hash of its first and last
+/// bytes and of evenly spaced parts between, so that a file changed in place, or a copy of it, is told apart without
+/// reading all of it.
+/// @param [in] filename The file summarized.
+/// @param [in] dat The file's data.
+/// @param [in] len Length of dat in bytes.
+QString summary_cache_path(const QString &filename, const unsigned char *dat, long len) {
+    QSettings settings;
+    if (!settings.value("summary_cache", true).toBool()) return QString();
+    // Smaller files are analyzed faster than the cache can be checked
+    if (len < settings.value("summary_cache_min_mb", 16).toLongLong() << 20) return QString();
+
+    QFileInfo fi(filename);
+    if (!fi.isFile()) return QString();
+
+    uint64_t h = 0xcbf29ce484222325ULL;
+    if (len <= hash_part * hash_parts) {
+        h = hash_bytes(h, dat, len);
+    } else {
+        for (long i = 0; i < hash_parts; i++) {
+            long s = (len - hash_part) / (hash_parts - 1) * i;
+            h = hash_bytes(h, dat + s, hash_part);
+        }
+    }
+
+    QString dir = QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation) + "/binary_viewer";
+    return QString("%1/%2-%3-%4.summary").arg(dir)
+            .arg(qulonglong(len), 0, 16)
+            .arg(qulonglong(fi.lastModified().toMSecsSinceEpoch()), 0, 16)
+            .arg(qulonglong(h), 16, 16, QChar('0'));
+}
+
+/// read_summary_cache reads the summary cached at path, if any. The cached data is memory-mapped, and only the
+/// pyramid levels and the index, along with the overview, are copied out of it.
+/// @param [in] path The cache file, from summary_cache_path().
+/// @param [in] len Length of the file summarized, which the cached summary must match.
+/// @param [out] summary The overview, pyramid and index. The range histogram is left to the caller.
+/// @return Whether a valid summary was read.
+bool read_summary_cache(const QString &path, long len, FileSummary &summary) {
+    MappedFile f;
+    if (path.isEmpty() || !f.open(path.toStdString())) return false;
+
+    summary_header_t hdr;
+    if (f.size() < long(sizeof(hdr))) return false;
+    memcpy(&hdr, f.data(), sizeof(hdr));
+    if (hdr.magic != summary_magic || hdr.version != summary_version || hdr.len != len || hdr.total != f.size()) {
+        return false;
+    }
+    // The block sizes must be those the pyramid and index could have been built with
+    if (len <= 0 || hdr.bs <= 0 || hdr.pyramid_block <= 0 || hdr.pyramid_block % hdr.bs != 0 ||
+        hdr.index_block <= 0 || (hdr.index_block & (hdr.index_block - 1)) != 0 ||
+        hdr.index_n_counts != ((len - 1) / hdr.index_block + 2) * 256) {
+        return false;
+    }
+    // Every section must lie within the file
+    if (hdr.w <= 0 || hdr.h <= 0 || hdr.n_levels <= 0 ||
+        !fits(hdr.overview_offset, int64_t(hdr.w) * hdr.h, 4, hdr.total) ||
+        !fits(hdr.levels_offset, hdr.n_levels, sizeof(int64_t), hdr.total) ||
+        !fits(hdr.index_offset, hdr.index_n_counts, sizeof(uint64_t), hdr.total)) {
+        return false;
+    }
+
+    FileSummary s;
+    s.w = hdr.w;
+    s.h = hdr.h;
+    s.use_byte_classes = hdr.flags & use_byte_classes_flag;
+    s.use_hilbert_curve = hdr.flags & use_hilbert_curve_flag;
+    s.overview = QImage(hdr.w, hdr.h, QImage::Format_RGB32);
+    for (int y = 0; y < hdr.h; y++) {
+        memcpy(s.overview.scanLine(y), f.data() + hdr.overview_offset + long(y) * hdr.w * 4, hdr.w * 4);
+    }
+
+    s.pyramid.bs = hdr.bs;
+    s.pyramid.block = hdr.pyramid_block;
+    s.pyramid.n = len;
+    s.pyramid.levels.resize(hdr.n_levels);
+    long off = align(hdr.levels_offset + long(hdr.n_levels) * long(sizeof(int64_t)));
+    long blk = hdr.pyramid_block;
+    for (int i = 0; i < hdr.n_levels; i++) {
+        int64_t n;
+        memcpy(&n, f.data() + hdr.levels_offset + i * long(sizeof(n)), sizeof(n));
+        // Each level covers the file with blocks four times those of the previous
+        if (n != (len - 1) / blk + 1 || !fits(off, n, sizeof(block_stats_t), hdr.index_offset)) return false;
+        blk = blk <= len / 4 ? blk * 4 : len;
+        long bytes = long(n * sizeof(block_stats_t));
+        auto &l = s.pyramid.levels[i];
+        l.resize(n);
+        memcpy(l.data(), f.data() + off, bytes);
+        off = align(off + bytes);
+    }
+
+    s.index.block = hdr.index_block;
+    s.index.n = len;
+    s.index.counts.resize(hdr.index_n_counts);
+    memcpy(s.index.counts.data(), f.data() + hdr.index_offset, hdr.index_n_counts * sizeof(uint64_t));
+
+    summary = std::move(s);
+    return true;
+}
+
+/// prune_summary_cache deletes the least recently written summaries in dir until they fit the summary_cache_mb
+/// setting.
+static void prune_summary_cache(const QDir &dir) {
+    long budget = QSettings().value("summary_cache_mb", 1024).toLongLong() << 20;
+
+    QFileInfoList files = dir.entryInfoList(QStringList("*.summary"), QDir::Files, QDir::Time);
+    long used = 0;
+    for (const auto &fi : files) {
+        used += fi.size();
+        if (used > budget) QFile::remove(fi.absoluteFilePath());
+    }
+}
+
+/// write_summary_cache caches the overview, pyramid and index of summary at path. The file is replaced atomically,
+/// so a reader never sees a partial summary.
+/// @return Whether the summary was written.
+bool write_summary_cache(const QString &path, const FileSummary &summary) {
+    if (path.isEmpty() || summary.overview.isNull() || !summary.pyramid.isValid() || !summary.index.isValid()) {
+        return false;
+    }
+
+    QDir dir = QFileInfo(path).absoluteDir();
+    if (!dir.mkpath(".")) return false;
+
+    QImage img = summary.overview.convertToFormat(QImage::Format_RGB32);
+    const auto &levels = summary.pyramid.levels;
+
+    summary_header_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = summary_magic;
+    hdr.version = summary_version;
+    hdr.flags = (summary.use_byte_classes ? use_byte_classes_flag : 0) |
+                (summary.use_hilbert_curve ? use_hilbert_curve_flag : 0);
+    hdr.len = summary.pyramid.n;
+    hdr.w = img.width();
+    hdr.h = img.height();
+    hdr.overview_offset = align(sizeof(hdr));
+    hdr.bs = summary.pyramid.bs;
+    hdr.n_levels = int32_t(levels.size());
+    hdr.pyramid_block = summary.pyramid.block;
+    hdr.levels_offset = align(hdr.overview_offset + long(hdr.w) * hdr.h * 4);
+    long off = align(hdr.levels_offset + long(levels.size() * sizeof(int64_t)));
+    for (const auto &l : levels) off = align(off + long(l.size() * sizeof(block_stats_t)));
+    hdr.index_block = summary.index.block;
+    hdr.index_n_counts = long(summary.index.counts.size());
+    hdr.index_offset = off;
+    hdr.total = hdr.index_offset + hdr.index_n_counts * long(sizeof(uint64_t));
+
+    QSaveFile f(path);
+    if (!f.open(QIODevice::WriteOnly)) return false;
+
+    static const char zeros[section_align] = {};
+    long pos = 0;
+    auto write = [&](const void *p, long n) {
+        f.write((const char *) p, n);
+        pos += n;
+    };
+    auto pad = [&]() { write(zeros, align(pos) - pos); };
+
+    write(&hdr, sizeof(hdr));
+    pad();
+    for (int y = 0; y < hdr.h; y++) write(img.constScanLine(y), hdr.w * 4);
+    pad();
+    for (const auto &l : levels) {
+        int64_t n = l.size();
+        write(&n, sizeof(n));
+    }
+    pad();
+    for (const auto &l : levels) {
+        write(l.data(), long(l.size() * sizeof(block_stats_t)));
+        pad();
+    }
+    write(summary.index.counts.data(), hdr.index_n_counts * long(sizeof(uint64_t)));
+
+    if (pos != hdr.total || !f.commit()) return false;
+
+    prune_summary_cache(dir);
+    return true;
+}
@@ -0,0 +1,33 @@
+/*
+ * Copyright (c) 2015, 2017, 2020 Kent A. Vander Velden, kent.vandervelden@gmail.com
+ *
+ * This file is part of BinVis.
+ *
+ *     BinVis is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     BinVis is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with BinVis.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SUMMARY_CACHE_H_
+#define _SUMMARY_CACHE_H_
+
+#include <QString>
+
+#include "file_loader.h"
+
+QString summary_cache_path(const QString &filename, const unsigned char *dat, long len);
+
+bool read_summary_cache(const QString &path, long len, FileSummary &summary);
+
+bool write_summary_cache(const QString &path, const FileSummary &summary);
+
+#endif
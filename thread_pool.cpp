@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) 2015, 2017, 2020 Kent A. Vander Velden, kent.vandervelden@gmail.com
+ *
+ * This file is part of BinVis.
+ *
+ *     BinVis is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     BinVis is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with BinVis.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "thread_pool.h"
+
+// The account charged by the CpuCharge innermost on each thread, if any
+static thread_local std::atomic<int64_t> *cur_account = nullptr;
+
+#if defined(_WIN32)
+static int64_t filetime_ns(const FILETIME &ft) {
+    return int64_t(((uint64_t) ft.dwHighDateTime << 32 | ft.dwLowDateTime) * 100);
+}
+#endif
+
+/// thread_cpu_ns returns the CPU time used by the calling thread, in nanoseconds.
+int64_t thread_cpu_ns() {
+#if defined(_WIN32)
+    FILETIME c, e, k, u;
+    if (!GetThreadTimes(GetCurrentThread(), &c, &e, &k, &u)) return 0;
+    return filetime_ns(k) + filetime_ns(u);
+#else
+    timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) return 0;
+    return int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/// process_cpu_ns returns the CPU time used by all threads of the process, in nanoseconds, including those a software
+/// OpenGL implementation rasterizes on.
+int64_t process_cpu_ns() {
+#if defined(_WIN32)
+    FILETIME c, e, k, u;
+    if (!GetProcessTimes(GetCurrentProcess(), &c, &e, &k, &u)) return 0;
+    return filetime_ns(k) + filetime_ns(u);
+#else
+    timespec ts;
+    if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) != 0) return 0;
+    return int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/// CpuCharge starts charging the calling thread's CPU time to account, or does nothing if account is nullptr.
+CpuCharge::CpuCharge(std::atomic<int64_t> *account)
+        : account_(account), prev_(cur_account), start_(account ? thread_cpu_ns() : 0) {
+    if (account_) cur_account = account_;
+}
+
+CpuCharge::~CpuCharge() {
+    if (!account_) return;
+
+    *account_ += thread_cpu_ns() - start_;
+    cur_account = prev_;
+}
+
+/// current returns the account the calling thread is charging, or nullptr if none.
+std::atomic<int64_t> *CpuCharge::current() {
+    return cur_account;
+}
+
+/// ThreadPool starts the worker threads. At least one is started, even where parallel_for() may use none, so that
+/// submitted work never runs on the submitting thread.
+/// @param [in] n_threads Number of workers, or -1 for one less than the number of hardware threads, since the
+///                       thread calling parallel_for() takes part in the work.
+ThreadPool::ThreadPool(int n_threads) : done_(false) {
+    if (n_threads < 0) {
+        n_threads = std::max(0, int(std::thread::hardware_concurrency()) - 1);
+    }
+    helpers_ = n_threads;
+
+    for (int i = 0; i < std::max(1, n_threads); i++) {
+        threads_.emplace_back(&ThreadPool::worker, this);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lk(m_);
+        done_ = true;
+    }
+    cv_.notify_all();
+
+    for (auto &t : threads_) {
+        t.join();
+    }
+}
+
+/// instance returns the pool shared by the whole application.
+ThreadPool &ThreadPool::instance() {
+    static ThreadPool pool;
+    return pool;
+}
+
+/// submit queues fn to be run by a worker.
+void ThreadPool::submit(std::function<void()> fn) {
+    {
+        std::lock_guard<std::mutex> lk(m_);
+        queue_.push_back(std::move(fn));
+    }
+    cv_.notify_one();
+}
+
+/// parallel_for calls fn(i) for each i in [0, n), spreading the calls over the workers and the calling thread, and
+/// returns once all calls have completed. The calling thread claims indices like any worker, so parallel_for may
+/// be used from within a task already running on the pool without deadlocking.
+/// @param [in] n Number of calls.
+/// @param [in] fn The function to call.
+void ThreadPool::parallel_for(long n, const std::function<void(long)> &fn) {
+    if (n <= 0) return;
+
+    if (n == 1 || helpers_ == 0) {
+        for (long i = 0; i < n; i++) fn(i);
+        return;
+    }
+
+    struct job_t {
+        std::atomic<long> next;
+        std::atomic<long> done;
+        std::mutex m;
+        std::condition_variable cv;
+    };
+    auto job = std::make_shared<job_t>();
+    job->next = 0;
+    job->done = 0;
+
+    // Helpers that start after every index has been claimed return without touching fn, or the caller's account,
+    // which may be gone by then. The others charge their time to the caller's account before reporting done.
+    std::atomic<int64_t> *account = CpuCharge::current();
+    auto run = [job, n, &fn, account]() {
+        long cnt = 0;
+        {
+            std::unique_ptr<CpuCharge> charge;
+            for (long i; (i = job->next++) < n; cnt++) {
+                if (!charge) charge.reset(new CpuCharge(CpuCharge::current() == account ? nullptr : account));
+                fn(i);
+            }
+        }
+        if (cnt > 0 && job->done.fetch_add(cnt) + cnt == n) {
+            std::lock_guard<std::mutex> lk(job->m);
+            job->cv.notify_all();
+        }
+    };
+
+    long helpers = std::min(n - 1, long(helpers_));
+    for (long i = 0; i < helpers; i++) {
+        submit(run);
+    }
+    run();
+
+    std::unique_lock<std::mutex> lk(job->m);
+    job->cv.wait(lk, [&]() { return job->done == n; });
+}
+
+void ThreadPool::worker() {
+    for (;;) {
+        std::function<void()> fn;
+        {
+            std::unique_lock<std::mutex> lk(m_);
+            cv_.wait(lk, [this]() { return done_ || !queue_.empty(); });
+            if (done_ && queue_.empty()) return;
+            fn = std::move(queue_.front());
+            queue_.pop_front();
+        }
+        fn();
+    }
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2015, 2017, 2020 Kent A. Vander Velden, kent.vandervelden@gmail.com
+ *
+ * This file is part of BinVis.
+ *
+ *     BinVis is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     BinVis is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with BinVis.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _THREAD_POOL_H_
+#define _THREAD_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+int64_t thread_cpu_ns();
+
+int64_t process_cpu_ns();
+
+/// CpuCharge adds the CPU time of its thread, from its construction to its destruction, to an account. While it is
+/// in scope, the workers helping its thread in a parallel_for() charge their time to the same account.
+class CpuCharge {
+public:
+    explicit CpuCharge(std::atomic<int64_t> *account);
+
+    ~CpuCharge();
+
+    CpuCharge(const CpuCharge &) = delete;
+
+    CpuCharge &operator=(const CpuCharge &) = delete;
+
+    static std::atomic<int64_t> *current();
+
+protected:
+    std::atomic<int64_t> *account_;
+    std::atomic<int64_t> *prev_;
+    int64_t start_;
+};
+
+/// ThreadPool is a fixed set of worker threads shared by the analysis kernels.
+class ThreadPool {
+public:
+    explicit ThreadPool(int n_threads = -1);
+
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    static ThreadPool &instance();
+
+    int size() const { return helpers_ + 1; }
+
+    void submit(std::function<void()> fn);
+
+    void parallel_for(long n, const std::function<void(long)> &fn);
+
+protected:
+    void worker();
+
+    std::vector<std::thread> threads_;
+    // Workers parallel_for() may use, which may be fewer than threads_
+    int helpers_;
+    std::deque<std::function<void()> > queue_;
+    std::mutex m_;
+    std::condition_variable cv_;
+    bool done_;
+};
+
+#endif